@@ -10,12 +10,42 @@ extern "C"
 
 #include <stdint.h>
 
+typedef enum
+{
+    LWCAN_BUFFER_TYPE_HEAP,   /** Header and payload are separate heap allocations */
+
+    LWCAN_BUFFER_TYPE_INLINE, /** Payload follows the header in the same heap allocation */
+
+    LWCAN_BUFFER_TYPE_REF,    /** Payload is memory owned by the caller, released through a callback */
+
+    LWCAN_BUFFER_TYPE_POSTED, /** Like LWCAN_BUFFER_TYPE_REF, but the header comes from a memory pool */
+
+    LWCAN_BUFFER_TYPE_VIEW,   /** Header and payload live on the stack, valid only during the callback it is passed to */
+} lwcan_buffer_type_t;
+
+typedef void (*lwcan_buffer_release_function)(void *arg, const uint8_t *data);
+
 struct lwcan_buffer
 {
-    struct lwcan_buffer *next;
+    struct lwcan_buffer *next; /** Next message in a queue */
+
+    struct lwcan_buffer *segment; /** Next segment of the same message */
 
     uint8_t *payload;
 
+    uint32_t length; /** Length of the message from this segment to the end of the chain */
+
+    uint32_t segment_length; /** Length of the payload of this segment */
+
+    uint8_t type;
+
+    uint8_t ref; /** Number of references held on the message, counted in the first segment */
+};
+
+struct lwcan_buffer_iov
+{
+    uint8_t *base;
+
     uint32_t length;
 };
 
@@ -23,6 +53,13 @@ struct lwcan_buffer *lwcan_buffer_new(uint32_t length);
 
 void lwcan_buffer_delete(struct lwcan_buffer *buffer);
 
+lwcanerr_t lwcan_buffer_resize(struct lwcan_buffer **buffer, uint32_t length);
+
+lwcanerr_t lwcan_buffer_ref(struct lwcan_buffer *buffer);
+
+void lwcan_buffer_unref(struct lwcan_buffer *buffer);
+
+/* REF and VIEW buffers are read only, copying into them fails with ERROR_ARG */
 lwcanerr_t lwcan_buffer_copy_to(struct lwcan_buffer *buffer, const uint8_t *source, uint32_t length);
 
 lwcanerr_t lwcan_buffer_copy_to_offset(struct lwcan_buffer *buffer, const uint8_t *source, uint32_t length, uint32_t offset);
@@ -31,6 +68,8 @@ lwcanerr_t lwcan_buffer_copy_from(struct lwcan_buffer *buffer, uint8_t *distinat
 
 lwcanerr_t lwcan_buffer_copy_from_offset(struct lwcan_buffer *buffer, uint8_t *distination, uint32_t length, uint32_t offset);
 
+uint16_t lwcan_buffer_get_iov(struct lwcan_buffer *buffer, struct lwcan_buffer_iov *iov, uint16_t iov_num);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,8 +17,14 @@ typedef void (*canif_sent_function)(void *arg, lwcanerr_t error);
 
 typedef lwcanerr_t (*canif_input_function)(struct canif *canif, void *frame);
 
+/* count frames of frame_size bytes each, one after the other, such as filled by recvmmsg() or a DMA FIFO */
+typedef lwcanerr_t (*canif_input_batch_function)(struct canif *canif, void *frames, uint8_t frame_size, uint16_t count);
+
 typedef lwcanerr_t (*canif_output_function)(struct canif *canif, void *frame, uint8_t frame_size, uint32_t timeout, canif_sent_function sent, void *arg);
 
+/* Sends count frames laid out like for input_batch, sent is called once for all of them */
+typedef lwcanerr_t (*canif_output_batch_function)(struct canif *canif, void *frames, uint8_t frame_size, uint16_t count, uint32_t timeout, canif_sent_function sent, void *arg);
+
 typedef lwcanerr_t (*canif_set_bitrate_function)(struct canif *canif, uint32_t bitrate);
 
 typedef lwcanerr_t (*canif_set_filter_function)(struct canif *canif, struct can_filter *filter);
@@ -37,8 +43,12 @@ struct canif
 
     canif_input_function input;
 
+    canif_input_batch_function input_batch;
+
     canif_output_function output;
 
+    canif_output_batch_function output_batch; /** Optional, set by drivers which can queue several frames at once */
+
     canif_set_bitrate_function set_bitrate;
 
     canif_set_filter_function set_filter;
@@ -13,6 +13,7 @@ extern "C"
 #include "lwcan/error.h"
 #include "lwcan/buffer.h"
 #include "lwcan/can.h"
+#include "lwcan/timeouts.h"
 
 #include <stdint.h>
 
@@ -22,6 +23,10 @@ typedef void (*isotp_receive_function)(void *arg, struct isotp_pcb *pcb, struct
 
 typedef void (*isotp_receive_ff_function)(void *arg, struct isotp_pcb *pcb);
 
+typedef void (*isotp_receive_block_function)(void *arg, struct isotp_pcb *pcb, struct lwcan_buffer *buffer, uint32_t offset);
+
+typedef void (*isotp_receive_done_function)(void *arg, struct isotp_pcb *pcb, uint32_t length);
+
 typedef void (*isotp_sent_function)(void *arg, struct isotp_pcb *pcb, uint32_t length);
 
 typedef void (*isotp_error_function)(void *arg, lwcanerr_t error);
@@ -34,10 +39,24 @@ struct isotp_flow
 
     struct lwcan_buffer *buffer;
 
+    struct lwcan_buffer *segment; /** Segment of the buffer the next consecutive frame starts in */
+
+    uint32_t segment_offset; /** Offset of the segment from the start of the buffer */
+
     uint32_t remaining_data;
 
+    uint32_t stream_remaining; /** Data of a streamed message after the current block */
+
+    uint32_t stream_offset; /** Offset of the current block in a streamed message */
+
+    uint32_t stream_block; /** Data length of a full block of consecutive frames in a streamed message */
+
     uint8_t cf_sn;  /** Consecutive frame serial number */
 
+    uint8_t cf_num; /** Consecutive frames transferred in the current block */
+
+    uint8_t cf_batch; /** Consecutive frames handed to the interface in one output_batch call, 0 for one frame */
+
     uint8_t fs; /** Flow status */
 
     uint8_t bs; /** Block size */
@@ -45,6 +64,10 @@ struct isotp_flow
     uint8_t st; /** Separation time */
 
     uint8_t n_wft; /** Number of receiver wait frames */
+
+    struct lwcan_timer timer; /** N_Bs or N_Cr timeout of the flow */
+
+    struct lwcan_timer output_timer; /** Sends the next frame of the flow */
 };
 
 struct isotp_pcb
@@ -57,6 +80,10 @@ struct isotp_pcb
 
     isotp_receive_ff_function receive_ff;
 
+    isotp_receive_block_function receive_block;
+
+    isotp_receive_done_function receive_done;
+
     isotp_sent_function sent;
 
     isotp_error_function error;
@@ -70,6 +97,14 @@ struct isotp_pcb
     struct isotp_flow output_flow;
 
     struct isotp_flow input_flow;
+
+    struct lwcan_buffer *rx_buffers; /** Receive buffers posted by the application */
+
+    uint32_t mem_reserved; /** Heap memory kept free for this pcb, 0 for none */
+
+    uint32_t mem_quota; /** Heap memory this pcb may hold at most, 0 for no limit */
+
+    uint32_t mem_used; /** Heap memory held by the transfers of this pcb */
 };
 
 struct isotp_pcb *isotp_new(void);
@@ -78,20 +113,56 @@ lwcanerr_t isotp_bind(struct isotp_pcb *pcb, const struct addr_can *addr);
 
 void isotp_remove(struct isotp_pcb *pcb);
 
+/*
+ *  With ISOTP_SF_DIRECT a single frame message goes to the interface before isotp_send() returns, so a
+ *  synchronous driver runs the sent callback from inside isotp_send() instead of from a later timeout
+ */
 lwcanerr_t isotp_send(struct isotp_pcb *pcb, const uint8_t *data, uint32_t length);
 
+/*
+ *  Send data without copying it. The data must stay valid until release is called, which happens
+ *  once the message is sent or aborted. On an error return release is not called and the data stays with the caller
+ */
+lwcanerr_t isotp_send_ref(struct isotp_pcb *pcb, const uint8_t *data, uint32_t length, lwcan_buffer_release_function release, void *release_arg);
+
 lwcanerr_t isotp_received(struct isotp_pcb *pcb, struct lwcan_buffer *buffer);
 
+/*
+ *  Post memory for an incoming message to be reassembled in, so no heap is used for it. The buffer is handed to
+ *  the receive callback like any other, release is called once it is given back or the pcb is removed.
+ *  Needs LWCAN_BUFFER_POSTED_NUM > 0
+ */
+lwcanerr_t isotp_post_rx_buffer(struct isotp_pcb *pcb, uint8_t *data, uint32_t size, lwcan_buffer_release_function release, void *release_arg);
+
+/*
+ *  With ISOTP_SF_DIRECT a single frame message is handed over as a LWCAN_BUFFER_TYPE_VIEW buffer into the frame,
+ *  valid only until the callback returns. It does not use posted buffers and isotp_received() does nothing on it,
+ *  the data must be copied out if it is needed later
+ */
 lwcanerr_t isotp_set_receive_callback(struct isotp_pcb *pcb, isotp_receive_function receive);
 
 lwcanerr_t isotp_set_receive_ff_callback(struct isotp_pcb *pcb, isotp_receive_ff_function receive_ff);
 
+/*
+ *  Receive multi-frame messages in streaming mode: every block of ISOTP_RECEIVE_STREAM_BS consecutive frames is
+ *  handed to receive_block as soon as it is complete, and receive_done is called after the last one. Each block
+ *  must be given back with isotp_received(), the next block is not requested from the sender before that.
+ *  Single frame messages still go to the receive callback
+ */
+lwcanerr_t isotp_set_receive_block_callback(struct isotp_pcb *pcb, isotp_receive_block_function receive_block, isotp_receive_done_function receive_done);
+
 lwcanerr_t isotp_set_sent_callback(struct isotp_pcb *pcb, isotp_sent_function sent);
 
 lwcanerr_t isotp_set_error_callback(struct isotp_pcb *pcb, isotp_error_function error);
 
 lwcanerr_t isotp_set_callback_arg(struct isotp_pcb *pcb, void *arg);
 
+/*
+ *  Limit the heap memory held by the transfers of a pcb to quota bytes and keep reserved bytes of the heap
+ *  for it, which other pcbs can not take. A first frame which does not fit is answered with an overflow
+ */
+lwcanerr_t isotp_set_mem_limits(struct isotp_pcb *pcb, uint32_t reserved, uint32_t quota);
+
 #endif
 
 #ifdef __cplusplus
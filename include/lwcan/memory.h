@@ -6,14 +6,126 @@ extern "C"
 {
 #endif
 
+#include "lwcan/options.h"
+#include "lwcan/error.h"
+
+#include <stdint.h>
 #include <string.h>
 
+/* Subsystems heap allocations are accounted to when LWCAN_MEM_OWNER_STATS is enabled */
+typedef enum
+{
+    LWCAN_MEM_OWNER_APP,        /** Allocations made through lwcan_malloc() */
+
+    LWCAN_MEM_OWNER_BUFFER,     /** struct lwcan_buffer headers */
+
+    LWCAN_MEM_OWNER_ISOTP_RX,   /** ISOTP receive payloads */
+
+    LWCAN_MEM_OWNER_ISOTP_TX,   /** ISOTP transmit payloads */
+
+    LWCAN_MEM_OWNER_MAX
+} lwcan_mem_owner_t;
+
+/* Allocation classes, each is served from its own heap made of the regions added for it */
+typedef enum
+{
+    LWCAN_MEM_CLASS_DEFAULT,    /** Built-in LWCAN_MEM_SIZE heap, also used by classes without a region of their own */
+
+    LWCAN_MEM_CLASS_HEADER,     /** Small, frequently accessed structures such as struct lwcan_buffer */
+
+    LWCAN_MEM_CLASS_PAYLOAD,    /** Message payloads, which can be large */
+
+    LWCAN_MEM_CLASS_MAX
+} lwcan_mem_class_t;
+
+struct lwcan_mem_stats
+{
+    size_t total_size; /** Usable size of the heap */
+
+    size_t free_size; /** Bytes currently free, including block headers */
+
+    size_t minimum_ever_free_size; /** Lowest value free_size has had */
+
+    size_t largest_free_block; /** Size of the largest block an allocation can still be served from */
+
+    size_t free_blocks; /** Number of blocks the free space is split into */
+
+    uint8_t fragmentation; /** 0 if all free space is one block, approaching 100 as it is split into small blocks */
+
+    size_t allocations; /** Number of successful allocations */
+
+    size_t frees; /** Number of successful frees */
+
+    size_t failed_allocations; /** Number of allocations which returned NULL */
+};
+
+struct lwcan_mem_owner_stats
+{
+    size_t used; /** Bytes currently allocated by the owner */
+
+    size_t max; /** Highest value used has had */
+
+    size_t allocations; /** Number of successful allocations */
+
+    size_t failed_allocations; /** Number of allocations which returned NULL */
+};
+
+/*
+ *  Allocator behind lwcan_malloc(). realloc, usable_size and get_stats may be NULL,
+ *  the memory returned by malloc and realloc must be aligned to 8 bytes.
+ *  realloc must leave p untouched when it returns NULL
+ */
+struct lwcan_mem_backend
+{
+    void *(*malloc)(void *context, size_t size, lwcan_mem_class_t mem_class);
+
+    void (*free)(void *context, void *p);
+
+    void *(*realloc)(void *context, void *p, size_t size);
+
+    size_t (*usable_size)(void *context, void *p);
+
+    void (*get_stats)(void *context, lwcan_mem_class_t mem_class, struct lwcan_mem_stats *stats);
+
+    void *context; /** Passed to every function of the backend */
+};
+
+/* Must be called before lwcan_init() and any allocation, NULL selects the built-in heap */
+lwcanerr_t lwcan_mem_set_backend(const struct lwcan_mem_backend *backend);
+
 void *lwcan_malloc(size_t size);
 
+void *lwcan_malloc_class(size_t size, lwcan_mem_class_t mem_class);
+
+void *lwcan_malloc_owner(size_t size, lwcan_mem_owner_t owner, lwcan_mem_class_t mem_class);
+
 void *lwcan_calloc(size_t number, size_t size);
 
+void *lwcan_realloc(void *p, size_t size);
+
+/* mem_class must be the class p was allocated from, a block that has to move stays in that class */
+void *lwcan_realloc_class(void *p, size_t size, lwcan_mem_class_t mem_class);
+
 void lwcan_free(void *p);
 
+size_t lwcan_mem_usable_size(void *p);
+
+lwcanerr_t lwcan_mem_add_region(void *start, size_t size, lwcan_mem_class_t mem_class);
+
+lwcanerr_t lwcan_mem_get_stats(struct lwcan_mem_stats *stats);
+
+lwcanerr_t lwcan_mem_get_class_stats(lwcan_mem_class_t mem_class, struct lwcan_mem_stats *stats);
+
+/*
+ *  Bytes free for allocations of mem_class, the free_size of lwcan_mem_get_class_stats() without the rest of the
+ *  statistics. Constant time on the built-in heap, other backends are asked through get_stats (0 without it)
+ */
+size_t lwcan_mem_get_free_size(lwcan_mem_class_t mem_class);
+
+#if LWCAN_MEM_OWNER_STATS
+lwcanerr_t lwcan_mem_get_owner_stats(lwcan_mem_owner_t owner, struct lwcan_mem_owner_stats *stats);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
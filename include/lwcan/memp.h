@@ -0,0 +1,41 @@
+#ifndef LWCAN_MEMP_H
+#define LWCAN_MEMP_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "lwcan/options.h"
+#include "lwcan/error.h"
+
+#include <stdint.h>
+
+/* Identifiers of the fixed-size memory pools, one per entry in memp_std.h */
+typedef enum
+{
+#define LWCAN_MEMPOOL(name, num, size, desc) LWCAN_MEMP_##name,
+#include "lwcan/private/memp_std.h"
+    LWCAN_MEMP_MAX
+} lwcan_memp_t;
+
+struct lwcan_memp_stats
+{
+    uint16_t avail; /** Number of elements in the pool */
+
+    uint16_t used; /** Number of elements currently allocated */
+
+    uint16_t max; /** Highest number of elements ever allocated at once */
+
+    uint16_t err; /** Number of allocations which failed because the pool was empty */
+};
+
+const char *lwcan_memp_get_name(lwcan_memp_t type);
+
+lwcanerr_t lwcan_memp_get_stats(lwcan_memp_t type, struct lwcan_memp_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,12 +9,67 @@ extern "C"
 #include "lwcan_options.h"
 
 /*
- *  The amount of memory available for sending and receiving
+ *  The amount of memory available for sending and receiving.
+ *  Set to 0 if all heap memory is added with lwcan_mem_add_region()
  */
 #if !defined LWCAN_MEM_SIZE
 #define LWCAN_MEM_SIZE              512
 #endif
 
+/*
+ *  Maximum number of heap regions, including the built-in LWCAN_MEM_SIZE one
+ */
+#if !defined LWCAN_MEM_REGIONS_NUM
+#define LWCAN_MEM_REGIONS_NUM       4
+#endif
+
+/*
+ *  Size of the largest heap region. The TLSF heap sizes its free list index from it
+ */
+#if !defined LWCAN_MEM_REGION_SIZE_MAX
+#define LWCAN_MEM_REGION_SIZE_MAX   LWCAN_MEM_SIZE
+#endif
+
+/*
+ *  Use the two-level segregated fit (TLSF) heap instead of the first-fit heap.
+ *  Allocation and freeing then take constant time no matter how fragmented the heap is.
+ */
+#if !defined LWCAN_MEM_TLSF
+#define LWCAN_MEM_TLSF              0
+#endif
+
+/*
+ *  Tag every heap allocation with the subsystem that owns it and keep per-owner usage statistics,
+ *  see lwcan_mem_get_owner_stats(). Costs a small header per allocation.
+ */
+#if !defined LWCAN_MEM_OWNER_STATS
+#define LWCAN_MEM_OWNER_STATS       0
+#endif
+
+/*
+ *  Allocate the lwcan_buffer header and its payload as one heap block. Set to 0 to allocate them separately,
+ *  so headers and payloads can be placed in LWCAN_MEM_CLASS_HEADER and LWCAN_MEM_CLASS_PAYLOAD regions
+ */
+#if !defined LWCAN_BUFFER_INLINE
+#define LWCAN_BUFFER_INLINE         1
+#endif
+
+/*
+ *  Maximum payload length of one lwcan_buffer segment. Longer messages are stored in a chain of segments,
+ *  so they do not need one contiguous heap block. Set to 0 to always allocate one segment per message
+ */
+#if !defined LWCAN_BUFFER_SEGMENT_SIZE
+#define LWCAN_BUFFER_SEGMENT_SIZE   0
+#endif
+
+/*
+ *  Number of pooled lwcan_buffer headers for application memory posted to the stack,
+ *  such as receive buffers given to isotp_post_rx_buffer()
+ */
+#if !defined LWCAN_BUFFER_POSTED_NUM
+#define LWCAN_BUFFER_POSTED_NUM     0
+#endif
+
 /*
  *  Maximum number of active timeouts
  */
@@ -22,6 +77,53 @@ extern "C"
 #define LWCAN_TIMEOUTS_NUM          10
 #endif
 
+/*
+ *  Run on a virtual clock for simulation. lwcan provides system_now() and system_now_ns() itself, the time
+ *  only moves with lwcan_clock_advance_ns() and lwcan_clock_step(), so protocol runs take no wall clock time
+ */
+#if !defined LWCAN_VIRTUAL_CLOCK
+#define LWCAN_VIRTUAL_CLOCK         0
+#endif
+
+/*
+ *  The port provides system_now_ns(), a 64-bit monotonic time in nanoseconds used by lwcan_now_ns().
+ *  Otherwise lwcan_now_ns() extends system_now() to 64 bits and has a resolution of 1 ms
+ */
+#if !defined LWCAN_SYSTEM_NOW_NS
+#define LWCAN_SYSTEM_NOW_NS         LWCAN_VIRTUAL_CLOCK
+#endif
+
+/*
+ *  Number of calls lwcan_defer() can hold, they are run before any timer by lwcan_timeouts_handler()
+ */
+#if !defined LWCAN_DEFER_NUM
+#define LWCAN_DEFER_NUM             8
+#endif
+
+/*
+ *  Number of timeout handlers lwcan_timeouts_handler() keeps call counts, lateness and run time
+ *  histograms of, see lwcan_timeouts_get_handler_stats(). 0 compiles the statistics out
+ */
+#if !defined LWCAN_TIMEOUTS_STATS
+#define LWCAN_TIMEOUTS_STATS        0
+#endif
+
+/*
+ *  Number of bits of the time each level of the timeout wheel resolves, 2 to 5.
+ *  A level has 1 << LWCAN_TIMEOUT_WHEEL_BITS slots and enough levels are used to cover 32 bits
+ */
+#if !defined LWCAN_TIMEOUT_WHEEL_BITS
+#define LWCAN_TIMEOUT_WHEEL_BITS    4
+#endif
+
+/*
+ *  Maximum number of CAN interfaces added at once, 1 to 254. Sizes the tables which find an interface
+ *  by index or name in constant time
+ */
+#if !defined CANIF_MAX_NUM
+#define CANIF_MAX_NUM               4
+#endif
+
 /**
  * LWCAN_ISOTP == 1: Turn on ISOTP.
  */
@@ -68,6 +170,19 @@ extern "C"
 #define ISOTP_RECEIVE_ST            0
 #endif
 
+/*
+ *  Block size sent in flow control frames by a pcb receiving in streaming mode,
+ *  see isotp_set_receive_block_callback(). Each block is handed to the application separately
+ */
+#if !defined ISOTP_RECEIVE_STREAM_BS
+#define ISOTP_RECEIVE_STREAM_BS     8
+#endif
+
+/* The block size is a single byte of the flow control frame */
+#if ISOTP_RECEIVE_STREAM_BS < 1 || ISOTP_RECEIVE_STREAM_BS > 255
+#error "ISOTP_RECEIVE_STREAM_BS must be between 1 and 255"
+#endif
+
 /*
  *  Maximum limit to the number of FC WAIT a receiver is allowed to sent
  */
@@ -110,6 +225,23 @@ extern "C"
 #define ISOTP_N_CR                  1000
 #endif
 
+/*
+ *  Send single frames straight from the caller's data and pass received single frames to the receive callback
+ *  as a view into the frame, so no heap buffer is used for them. The view is only valid during the callback.
+ *  Off by default as it changes when the sent callback runs and what the receive callback gets (see isotp.h)
+ */
+#if !defined ISOTP_SF_DIRECT
+#define ISOTP_SF_DIRECT             0
+#endif
+
+/*
+ *  Most consecutive frames ISOTP hands to an interface with output_batch in one call, when the receiver
+ *  asks for no separation time. The frames are built on the stack. 1 sends one frame at a time
+ */
+#if !defined ISOTP_OUTPUT_BATCH_NUM
+#define ISOTP_OUTPUT_BATCH_NUM      8
+#endif
+
 /*
  *  Number of simultaneously active ISOTP connections.
  */
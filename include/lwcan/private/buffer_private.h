@@ -0,0 +1,36 @@
+#ifndef LWCAN_BUFFER_PRIVATE_H
+#define LWCAN_BUFFER_PRIVATE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "lwcan/buffer.h"
+#include "lwcan/memory.h"
+
+#include <stdint.h>
+
+/* A buffer referencing caller memory, the header is extended with the release callback */
+struct lwcan_buffer_ref
+{
+    struct lwcan_buffer buffer;
+
+    lwcan_buffer_release_function release;
+
+    void *release_arg;
+};
+
+struct lwcan_buffer *lwcan_buffer_alloc(uint32_t length, lwcan_mem_owner_t owner);
+
+lwcanerr_t lwcan_buffer_realloc(struct lwcan_buffer **buffer, uint32_t length, lwcan_mem_owner_t owner);
+
+struct lwcan_buffer *lwcan_buffer_alloc_ref(const uint8_t *data, uint32_t length, lwcan_buffer_release_function release, void *release_arg, lwcan_mem_owner_t owner);
+
+struct lwcan_buffer *lwcan_buffer_alloc_posted(uint8_t *data, uint32_t length, lwcan_buffer_release_function release, void *release_arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,6 +12,7 @@ extern "C" {
 #include "lwcan/isotp.h"
 #include "lwcan/canif.h"
 #include "lwcan/buffer.h"
+#include "lwcan/memory.h"
 #include "lwcan/can.h"
 
 #include <stdint.h>
@@ -76,6 +77,8 @@ typedef enum
 
     ISOTP_TX_SF,      /** Sending single frame */
 
+    ISOTP_TX_SF_DIRECT, /** Sending single frame encoded straight from the caller's data */
+
     ISOTP_TX_FF,      /** Sending first frame */
 
     ISOTP_TX_CF,      /** Sending consecutive frame */
@@ -85,12 +88,24 @@ typedef enum
     ISOTP_WAIT_CF,    /** Waiting for consecutive frame */
 
     ISOTP_WAIT_FC,    /** Waiting for flow control frame */
+
+    ISOTP_WAIT_RECEIVED, /** Waiting for the application to give back a streamed block */
 } isotp_state_t;
 
 void isotp_init(void);
 
+/* PCB the previous frame of a batch went to, reused as long as the PCB list has not changed */
+struct isotp_input_hint
+{
+    struct isotp_pcb *pcb;
+
+    uint16_t version;
+};
+
 void isotp_input(struct canif *canif, void *frame);
 
+void isotp_input_hinted(uint8_t if_index, void *frame, struct isotp_input_hint *hint);
+
 void isotp_out_flow_output(void *arg);
 
 void isotp_in_flow_output(void *arg);
@@ -99,20 +114,30 @@ void isotp_sent(void *arg, lwcanerr_t error);
 
 struct isotp_pcb *isotp_get_pcb_list(void);
 
+uint16_t isotp_get_pcb_list_version(void);
+
 uint8_t isotp_get_sf_dl(uint8_t *frame_data);
 
 uint32_t isotp_get_ff_dl(uint8_t *frame_data);
 
 void isotp_fill_sf(struct isotp_flow *flow, void *frame);
 
+void isotp_encode_sf(void *frame, const uint8_t *data, uint8_t length);
+
 void isotp_fill_ff(struct isotp_flow *flow, void *frame);
 
 void isotp_fill_cf(struct isotp_flow *flow, void *frame);
 
 void isotp_fill_fc(struct isotp_flow *flow, void *frame);
 
+struct lwcan_buffer *isotp_buffer_alloc(struct isotp_pcb *pcb, uint32_t length, lwcan_mem_owner_t owner);
+
 void isotp_remove_buffer(struct isotp_flow *flow, struct lwcan_buffer *buffer);
 
+void isotp_defer_output(struct isotp_flow *flow);
+
+struct lwcan_buffer *isotp_flow_segment(struct isotp_flow *flow, uint32_t *offset);
+
 void isotp_output_error_handler(void *arg);
 
 void isotp_input_error_handler(void *arg);
@@ -0,0 +1,37 @@
+#ifndef LWCAN_MEMORY_PRIVATE_H
+#define LWCAN_MEMORY_PRIVATE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "lwcan/memory.h"
+
+#include <stdint.h>
+
+/* Implemented by the heap selected in lwcan_options.h (memory_heap4.c or memory_tlsf.c).
+ * There is one heap per lwcan_mem_class_t, regions are validated by memory.c. */
+
+void lwcan_heap_add_region(uint8_t heap, void *start, size_t size);
+
+void *lwcan_heap_malloc(uint8_t heap, size_t size);
+
+void lwcan_heap_free(uint8_t heap, void *p);
+
+size_t lwcan_heap_usable_size(uint8_t heap, void *p);
+
+/* Resizes an allocated block without moving it, returns 0 and leaves the block
+ * untouched if the following memory is not free. */
+uint8_t lwcan_heap_resize(uint8_t heap, void *p, size_t size);
+
+/* Bytes currently free, kept up to date on every allocation so this does not walk the heap. */
+size_t lwcan_heap_free_size(uint8_t heap);
+
+void lwcan_heap_get_stats(uint8_t heap, struct lwcan_mem_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
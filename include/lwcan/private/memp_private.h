@@ -0,0 +1,21 @@
+#ifndef LWCAN_MEMP_PRIVATE_H
+#define LWCAN_MEMP_PRIVATE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "lwcan/memp.h"
+
+void lwcan_memp_init(void);
+
+void *lwcan_memp_malloc(lwcan_memp_t type);
+
+void lwcan_memp_free(lwcan_memp_t type, void *mem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
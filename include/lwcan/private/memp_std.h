@@ -0,0 +1,24 @@
+/*
+ * Pool descriptors, this file is included several times with different
+ * definitions of LWCAN_MEMPOOL(name, number of elements, element size, description)
+ */
+
+#ifndef LWCAN_MEMPOOL
+#error "LWCAN_MEMPOOL must be defined before including memp_std.h"
+#endif
+
+LWCAN_MEMPOOL(TIMEOUT, LWCAN_TIMEOUTS_NUM, sizeof(struct lwcan_timeout), "TIMEOUT")
+
+#if LWCAN_BUFFER_POSTED_NUM > 0
+LWCAN_MEMPOOL(BUFFER_POSTED, LWCAN_BUFFER_POSTED_NUM, sizeof(struct lwcan_buffer_ref), "BUFFER_POSTED")
+#endif
+
+#if LWCAN_ISOTP
+LWCAN_MEMPOOL(ISOTP_PCB, ISOTP_MAX_PCB_NUM, sizeof(struct isotp_pcb), "ISOTP_PCB")
+#endif
+
+#if LWCAN_RAW
+LWCAN_MEMPOOL(CANRAW_PCB, CANRAW_MAX_PCB_NUM, sizeof(struct canraw_pcb), "CANRAW_PCB")
+#endif
+
+#undef LWCAN_MEMPOOL
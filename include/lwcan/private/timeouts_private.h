@@ -6,6 +6,20 @@ extern "C"
 {
 #endif
 
+#include "lwcan/timeouts.h"
+
+#include <stdint.h>
+
+/* A timeout added with lwcan_timeout(), allocated from the TIMEOUT pool */
+struct lwcan_timeout
+{
+    struct lwcan_timer timer;
+
+    lwcan_timeout_handler handler;
+
+    void *arg;
+};
+
 void lwcan_timeouts_init(void);
 
 #ifdef __cplusplus
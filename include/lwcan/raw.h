@@ -40,16 +40,38 @@ struct canraw_pcb
     volatile uint8_t sent;
 
     volatile lwcanerr_t sent_error;
+
+    /* Frames the last canraw_send_batch() handed to the interface */
+    uint16_t batch_queued;
+
+    /* Completion state of a batch sent one frame at a time */
+    volatile uint32_t batch_pending;
+
+    volatile lwcanerr_t batch_error;
+
+    canif_sent_function batch_sent;
+
+    void *batch_arg;
 };
 
 struct canraw_pcb *canraw_new(void);
 
 lwcanerr_t canraw_bind(struct canraw_pcb *pcb, struct addr_can *addr);
 
-void canraw_remove(struct canraw_pcb *pcb);
+/* Fails with ERROR_INPROGRESS while a batch sent one frame at a time has not completed yet */
+lwcanerr_t canraw_remove(struct canraw_pcb *pcb);
 
 lwcanerr_t canraw_send(struct canraw_pcb *pcb, void *frame, uint8_t frame_size, uint32_t timeout, canif_sent_function sent, void *arg);
 
+/*
+ *  Send count frames of frame_size bytes each, one after the other, with a single completion like canraw_send().
+ *  Interfaces without output_batch get the frames one at a time, the completion follows the last of them and
+ *  reports the first error of any frame. Only one such batch can be outstanding per pcb, ERROR_INPROGRESS otherwise.
+ *  If the interface refuses a frame the error is returned and pcb->batch_queued tells how many frames went out
+ *  before it; when that is not 0 the completion still follows for them and reports the error as well
+ */
+lwcanerr_t canraw_send_batch(struct canraw_pcb *pcb, void *frames, uint8_t frame_size, uint16_t count, uint32_t timeout, canif_sent_function sent, void *arg);
+
 lwcanerr_t canraw_set_receive_callback(struct canraw_pcb *pcb, canraw_receive_function receive);
 
 lwcanerr_t canraw_set_callback_arg(struct canraw_pcb *pcb, void *arg);
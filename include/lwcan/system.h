@@ -10,6 +10,9 @@ extern "C"
 
 uint32_t system_now(void);
 
+/* Only needed with LWCAN_SYSTEM_NOW_NS. Both are provided by timeouts.c with LWCAN_VIRTUAL_CLOCK */
+uint64_t system_now_ns(void);
+
 #ifdef __cplusplus
 }
 #endif
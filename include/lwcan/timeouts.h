@@ -6,6 +6,9 @@ extern "C"
 {
 #endif
 
+#include "lwcan/options.h"
+#include "lwcan/error.h"
+
 #include <stdint.h>
 
 /** Function prototype for a timeout callback function. Register such a function
@@ -15,12 +18,153 @@ extern "C"
  */
 typedef void (*lwcan_timeout_handler)(void *arg);
 
+typedef enum
+{
+    LWCAN_TIMER_CATCH_UP_SKIP,  /** Periods missed while the handler was late are dropped, the timer keeps its phase */
+
+    LWCAN_TIMER_CATCH_UP_BURST, /** The handler is called once for every period missed */
+} lwcan_timer_catch_up_t;
+
+/* Returned by lwcan_timeouts_next_expiry() when no timer is armed */
+#define LWCAN_TIMEOUTS_NO_EXPIRY    0xffffffffU
+
+/*
+ *  Called when a timer or deferred call is added which is due before the deadline the host knows of, that is
+ *  the last one returned by lwcan_timeouts_next_expiry() or passed to this callback. time_ms is the time until
+ *  it is due. It is not called from within lwcan_timeouts_handler(), after which the host asks again anyway
+ */
+typedef void (*lwcan_timeouts_earliest_callback)(uint32_t time_ms);
+
+/*
+ *  Timer kept in memory owned by the caller, such as a protocol control block. Arming, re-arming and
+ *  cancelling take constant time and need no pool memory. Set up with lwcan_timer_init() before use,
+ *  the fields are private to timeouts.c
+ */
+struct lwcan_timer
+{
+    struct lwcan_timer *next;
+
+    struct lwcan_timer *prev; /** The lists are circular, the head's prev is the tail */
+
+    struct lwcan_timer **list; /** Head of the wheel slot or list the timer is in, NULL while not armed */
+
+    uint32_t time;
+
+    uint32_t period; /** 0 for a one-shot timer */
+
+    uint8_t catch_up;
+
+    lwcan_timeout_handler handler;
+
+    void *arg;
+};
+
 void lwcan_timeouts_handler(void);
 
+/*
+ *  Like lwcan_timeouts_handler(), but stops after max_calls handlers or once max_us microseconds have passed,
+ *  0 meaning no limit. At least one handler is run. Returns 1 if work remains, so the host can process
+ *  received frames before calling it again
+ */
+uint8_t lwcan_timeouts_handler_budget(uint16_t max_calls, uint32_t max_us);
+
+/*
+ *  Milliseconds until lwcan_timeouts_handler() has to be called next, 0 if it has work to do right away,
+ *  LWCAN_TIMEOUTS_NO_EXPIRY if there is nothing to wait for. Hosts can sleep that long instead of polling
+ */
+uint32_t lwcan_timeouts_next_expiry(void);
+
+/* Set or clear (NULL) the callback for a new earliest deadline */
+void lwcan_timeouts_set_earliest_callback(lwcan_timeouts_earliest_callback callback);
+
 void lwcan_timeout(uint32_t time_ms, lwcan_timeout_handler handler, void *arg);
 
 void lwcan_untimeout(lwcan_timeout_handler handler, void *arg);
 
+/*
+ *  Call handler from the next lwcan_timeouts_handler() pass, before any timer and in the order the calls were
+ *  deferred. Takes no pool memory and does no time keeping, fails with ERROR_MEMORY if LWCAN_DEFER_NUM calls are pending
+ */
+lwcanerr_t lwcan_defer(lwcan_timeout_handler handler, void *arg);
+
+/* Drop every pending deferred call of handler with arg */
+void lwcan_undefer(lwcan_timeout_handler handler, void *arg);
+
+void lwcan_timer_init(struct lwcan_timer *timer, lwcan_timeout_handler handler, void *arg);
+
+/* Fails with ERROR_INPROGRESS if the timer is already armed */
+lwcanerr_t lwcan_timer_arm(struct lwcan_timer *timer, uint32_t time_ms);
+
+/* Arms the timer, moving it to the new time if it was armed already */
+void lwcan_timer_rearm(struct lwcan_timer *timer, uint32_t time_ms);
+
+/*
+ *  Calls the handler every period_ms, the first time period_ms from now. Each deadline is counted from the
+ *  previous one rather than from when the handler ran, so the period does not drift. The timer is armed
+ *  again before its handler is called. Fails with ERROR_INPROGRESS if the timer is already armed
+ */
+lwcanerr_t lwcan_timer_arm_periodic(struct lwcan_timer *timer, uint32_t period_ms, lwcan_timer_catch_up_t catch_up);
+
+/* Arms the timer as periodic, restarting the period from now if it was armed already */
+void lwcan_timer_rearm_periodic(struct lwcan_timer *timer, uint32_t period_ms, lwcan_timer_catch_up_t catch_up);
+
+void lwcan_timer_cancel(struct lwcan_timer *timer);
+
+uint8_t lwcan_timer_is_armed(const struct lwcan_timer *timer);
+
+/* Monotonic time in nanoseconds, see LWCAN_SYSTEM_NOW_NS */
+uint64_t lwcan_now_ns(void);
+
+#if LWCAN_VIRTUAL_CLOCK
+/* Moves the virtual clock forward, such as by the time a frame takes on a simulated bus */
+void lwcan_clock_advance_ns(uint64_t time_ns);
+
+/*
+ *  One discrete event step: if nothing is due, the virtual clock jumps to the next deadline, then everything
+ *  due is run. Call it once all simulated nodes and buses are idle. Returns 0 if no timer is armed
+ */
+uint8_t lwcan_clock_step(void);
+#endif
+
+#if LWCAN_TIMEOUTS_STATS
+/* Bucket 0 of a histogram counts zero values, bucket i counts 2^(i-1) to 2^i - 1, the last one everything above */
+#define LWCAN_TIMEOUTS_STATS_BUCKETS 16
+
+struct lwcan_timeouts_stats
+{
+    uint16_t armed; /** Timers armed now, pooled and caller-owned. Pool usage is in lwcan_memp_get_stats() */
+
+    uint16_t armed_max; /** Highest number of timers ever armed at once */
+
+    uint8_t deferred_max; /** Highest number of calls ever waiting in the lwcan_defer() queue */
+
+    uint32_t untracked; /** Timer handler calls which found the LWCAN_TIMEOUTS_STATS handler table full */
+};
+
+struct lwcan_timeouts_handler_stats
+{
+    lwcan_timeout_handler handler; /** The handler given to lwcan_timeout() or lwcan_timer_init() */
+
+    uint32_t count;
+
+    uint32_t late_max; /** In milliseconds */
+
+    uint32_t run_max; /** In microseconds */
+
+    uint32_t late[LWCAN_TIMEOUTS_STATS_BUCKETS]; /** Time from the deadline to the call, in milliseconds */
+
+    uint32_t run[LWCAN_TIMEOUTS_STATS_BUCKETS]; /** Time the handler ran, in microseconds, see LWCAN_SYSTEM_NOW_NS */
+};
+
+lwcanerr_t lwcan_timeouts_get_stats(struct lwcan_timeouts_stats *stats);
+
+/* Handlers are numbered in the order they first fired, ERROR_ARG past the last one */
+lwcanerr_t lwcan_timeouts_get_handler_stats(uint8_t index, struct lwcan_timeouts_handler_stats *stats);
+
+/* Clears the counters and histograms, armed stays as it is */
+void lwcan_timeouts_reset_stats(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,7 @@
 
 #include "lwcan/isotp.h"
 #include "lwcan/timeouts.h"
+#include "lwcan/memory.h"
 #include "lwcan/system.h"
 
 #include <string.h>
@@ -44,6 +45,8 @@ struct uds_state
 
     uint8_t with_response;
 
+    uint8_t keep_session_sending; /** The request being sent is the tester present of the S3 timer */
+
     uint16_t p2;
 
     uint16_t p2_star;
@@ -61,6 +64,14 @@ struct uds_state
 
 static volatile struct uds_state uds_state;
 
+static struct lwcan_timer connect_timer;
+
+static struct lwcan_timer p2_timer;
+
+static struct lwcan_timer p2_star_timer;
+
+static struct lwcan_timer s3_timer;
+
 static void connect_try(void *arg)
 {
     uint8_t request[2];
@@ -105,7 +116,13 @@ static void s3_timer_handler(void *arg)
     request[0] = UDS_TESTER_PRESENT_SID;
     request[1] = UDS_KEEP_SESSION_SUPPRESS;
 
-    uds_send_request(request, 2, 0);
+    /* Set before sending, a synchronous driver completes the tester present inside uds_send_request() */
+    uds_state.keep_session_sending = 1;
+
+    if (uds_send_request(request, 2, 0) != ERROR_OK)
+    {
+        uds_state.keep_session_sending = 0;
+    }
 #else
     uds_state.is_connected = 0;
 
@@ -134,7 +151,7 @@ static void p2_timer_handler(void *arg)
             connect_timeout = UDS_CONNECT_RETRY_TIMEOUT - connect_passed_time;
         }
 
-        lwcan_timeout(connect_timeout, connect_try, NULL);
+        lwcan_timer_rearm(&connect_timer, connect_timeout);
 
         return;
     }
@@ -177,7 +194,7 @@ static void handle_negative_response(struct lwcan_buffer *buffer)
             uds_state.state = UDS_RESPONSE_PENDING;
         }
 
-        lwcan_timeout(uds_state.p2_star, p2_star_timer_handler, NULL);
+        lwcan_timer_rearm(&p2_star_timer, uds_state.p2_star);
 
         return;
     }
@@ -192,6 +209,8 @@ static void handle_negative_response(struct lwcan_buffer *buffer)
 
 static void handle_positive_response(struct lwcan_buffer *buffer)
 {
+    uint8_t *data;
+
     if (uds_state.state == UDS_CONNECTING)
     {
         uds_state.is_connected = 1;
@@ -205,7 +224,31 @@ static void handle_positive_response(struct lwcan_buffer *buffer)
 
     if (uds_state.context != NULL && uds_state.context->positive_response != NULL)
     {
-        uds_state.context->positive_response(uds_state.handle, buffer->payload, buffer->length);
+        if (buffer->segment == NULL)
+        {
+            uds_state.context->positive_response(uds_state.handle, buffer->payload, buffer->length);
+        }
+        else
+        {
+            /* The response callback takes contiguous data, a segmented response is gathered first */
+            data = (uint8_t *)lwcan_malloc(buffer->length);
+
+            if (data == NULL)
+            {
+                if (uds_state.context->error != NULL)
+                {
+                    uds_state.context->error(uds_state.handle, ERROR_MEMORY);
+                }
+            }
+            else
+            {
+                lwcan_buffer_copy_from(buffer, data, buffer->length);
+
+                uds_state.context->positive_response(uds_state.handle, data, buffer->length);
+
+                lwcan_free(data);
+            }
+        }
     }
 
     uds_state.state = UDS_IDLE;
@@ -224,13 +267,13 @@ static void uds_receive(void *arg, struct isotp_pcb *isotp_pcb, struct lwcan_buf
     switch (uds_state.state)
     {
     case UDS_WAIT_RESPONSE:
-        lwcan_untimeout(p2_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_timer);
         break;
     case UDS_CONNECTING:
-        lwcan_untimeout(p2_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_timer);
         break;
     case UDS_RESPONSE_PENDING:
-        lwcan_untimeout(p2_star_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_star_timer);
         break;
     default:
         break;
@@ -262,10 +305,10 @@ static void uds_receive_ff(void *arg, struct isotp_pcb *isotp_pcb)
     switch (uds_state.state)
     {
     case UDS_WAIT_RESPONSE:
-        lwcan_untimeout(p2_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_timer);
         break;
     case UDS_RESPONSE_PENDING:
-        lwcan_untimeout(p2_star_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_star_timer);
         break;
     default:
         break;
@@ -293,7 +336,7 @@ static void uds_error(void *arg, lwcanerr_t error)
             connect_timeout = UDS_CONNECT_RETRY_TIMEOUT - connect_passed_time;
         }
 
-        lwcan_timeout(connect_timeout, connect_try, NULL);
+        lwcan_timer_rearm(&connect_timer, connect_timeout);
 
         return;
     }
@@ -306,10 +349,10 @@ static void uds_error(void *arg, lwcanerr_t error)
     switch (uds_state.state)
     {
     case UDS_WAIT_RESPONSE:
-        lwcan_untimeout(p2_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_timer);
         break;
     case UDS_RESPONSE_PENDING:
-        lwcan_untimeout(p2_star_timer_handler, NULL);
+        lwcan_timer_cancel(&p2_star_timer);
         break;
     default:
         break;
@@ -320,6 +363,8 @@ static void uds_error(void *arg, lwcanerr_t error)
         uds_state.context->error(uds_state.handle, error);
     }
 
+    uds_state.keep_session_sending = 0;
+
     uds_state.state = UDS_IDLE;
 }
 
@@ -331,7 +376,7 @@ static void uds_sent(void *arg, struct isotp_pcb *pcb, uint32_t length)
 
     if (uds_state.state == UDS_CONNECTING)
     {
-        lwcan_timeout(uds_state.p2, p2_timer_handler, NULL);
+        lwcan_timer_rearm(&p2_timer, uds_state.p2);
 
         return;
     }
@@ -345,16 +390,26 @@ static void uds_sent(void *arg, struct isotp_pcb *pcb, uint32_t length)
     {
         uds_state.state = UDS_WAIT_RESPONSE;
 
-        lwcan_timeout(uds_state.p2, p2_timer_handler, NULL);
+        lwcan_timer_rearm(&p2_timer, uds_state.p2);
     }
     else
     {
         uds_state.state = UDS_IDLE;
     }
 
-    lwcan_untimeout(s3_timer_handler, NULL);
-
-    lwcan_timeout(UDS_S3_CLIENT, s3_timer_handler, NULL);
+#if UDS_KEEP_SESSION
+    /* The tester present keeps to the period of the S3 timer, any other request restarts it */
+    if (uds_state.keep_session_sending)
+    {
+        uds_state.keep_session_sending = 0;
+    }
+    else
+    {
+        lwcan_timer_rearm_periodic(&s3_timer, UDS_S3_CLIENT, LWCAN_TIMER_CATCH_UP_SKIP);
+    }
+#else
+    lwcan_timer_rearm(&s3_timer, UDS_S3_CLIENT);
+#endif
 }
 
 /**
@@ -389,6 +444,14 @@ lwcanerr_t uds_client_init(void)
 
     uds_state.p2_star = UDS_P2_STAR_DEFAULT;
 
+    lwcan_timer_init(&connect_timer, connect_try, NULL);
+
+    lwcan_timer_init(&p2_timer, p2_timer_handler, NULL);
+
+    lwcan_timer_init(&p2_star_timer, p2_star_timer_handler, NULL);
+
+    lwcan_timer_init(&s3_timer, s3_timer_handler, NULL);
+
     return ERROR_OK;
 }
 
@@ -406,10 +469,13 @@ lwcanerr_t uds_client_deinit(void)
 
     isotp_remove(uds_state.isotp_pcb);
 
-    if (uds_state.is_connected)
-    {
-        lwcan_untimeout(s3_timer_handler, NULL);
-    }
+    lwcan_timer_cancel(&connect_timer);
+
+    lwcan_timer_cancel(&p2_timer);
+
+    lwcan_timer_cancel(&p2_star_timer);
+
+    lwcan_timer_cancel(&s3_timer);
 
     memset((void *)&uds_state, 0, sizeof(uds_state));
 
@@ -471,11 +537,11 @@ void uds_client_disconnect(void)
 
     uds_state.state = UDS_IDLE;
 
-    lwcan_untimeout(p2_timer_handler, NULL);
+    lwcan_timer_cancel(&p2_timer);
 
-    lwcan_untimeout(p2_star_timer_handler, NULL);
+    lwcan_timer_cancel(&p2_star_timer);
 
-    lwcan_untimeout(s3_timer_handler, NULL);
+    lwcan_timer_cancel(&s3_timer);
 
     uds_state.is_connected = 0;
 
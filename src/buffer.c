@@ -1,23 +1,118 @@
 #include "lwcan/buffer.h"
+#include "lwcan/private/buffer_private.h"
 #include "lwcan/error.h"
 #include "lwcan/options.h"
 #include "lwcan/memory.h"
+#include "lwcan/private/memp_private.h"
 #include "lwcan/debug.h"
 
 #include <string.h>
 
+/* The payload of an inline buffer starts at the first aligned address after the header */
+#define BUFFER_HEADER_SIZE ((sizeof(struct lwcan_buffer) + 7U) & ~((size_t)7U))
+
+#if LWCAN_BUFFER_SEGMENT_SIZE > 0 && LWCAN_BUFFER_SEGMENT_SIZE < 8
+#error "LWCAN_BUFFER_SEGMENT_SIZE must be 0 or at least 8"
+#endif
+
+static void buffer_release_ref(struct lwcan_buffer *buffer)
+{
+    struct lwcan_buffer_ref *ref;
+
+    lwcan_buffer_release_function release;
+
+    void *release_arg;
+
+    const uint8_t *data;
+
+    ref = (struct lwcan_buffer_ref *)buffer;
+
+    release = ref->release;
+
+    release_arg = ref->release_arg;
+
+    data = ref->buffer.payload;
+
+    /* The header is freed first, so the callback can reuse the memory right away */
+#if LWCAN_BUFFER_POSTED_NUM > 0
+    if (ref->buffer.type == LWCAN_BUFFER_TYPE_POSTED)
+    {
+        lwcan_memp_free(LWCAN_MEMP_BUFFER_POSTED, ref);
+    }
+    else
+#endif
+    {
+        lwcan_free(ref);
+    }
+
+    if (release != NULL)
+    {
+        release(release_arg, data);
+    }
+}
+
+static void buffer_free(struct lwcan_buffer *buffer)
+{
+    struct lwcan_buffer *segment;
+
+    while (buffer != NULL)
+    {
+        segment = buffer->segment;
+
+        switch (buffer->type)
+        {
+        case LWCAN_BUFFER_TYPE_REF:
+        case LWCAN_BUFFER_TYPE_POSTED:
+            buffer_release_ref(buffer);
+            break;
+
+        case LWCAN_BUFFER_TYPE_VIEW:
+            /* Neither the header nor the payload of a view belong to the stack */
+            break;
+
+        case LWCAN_BUFFER_TYPE_HEAP:
+            lwcan_free(buffer->payload);
+            lwcan_free(buffer);
+            break;
+
+        default:
+            lwcan_free(buffer);
+            break;
+        }
+
+        buffer = segment;
+    }
+}
+
 struct lwcan_buffer *lwcan_buffer_new(uint32_t length)
+{
+    return lwcan_buffer_alloc(length, LWCAN_MEM_OWNER_APP);
+}
+
+static struct lwcan_buffer *buffer_alloc_segment(uint32_t length, lwcan_mem_owner_t owner)
 {
     struct lwcan_buffer *buffer;
 
-    if (length == 0)
+#if LWCAN_BUFFER_INLINE
+    if ((BUFFER_HEADER_SIZE + (size_t)length) < (size_t)length)
     {
-        LWCAN_ASSERT("length != 0", length != 0);
+        return NULL;
+    }
+
+    buffer = (struct lwcan_buffer *)lwcan_malloc_owner(BUFFER_HEADER_SIZE + length, owner, LWCAN_MEM_CLASS_PAYLOAD);
+
+    if (buffer == NULL)
+    {
+        LWCAN_ASSERT("buffer != NULL", buffer != NULL);
 
         return NULL;
     }
 
-    buffer = (struct lwcan_buffer *)lwcan_malloc(sizeof(struct lwcan_buffer));
+    buffer->payload = (uint8_t *)buffer + BUFFER_HEADER_SIZE;
+
+    buffer->type = LWCAN_BUFFER_TYPE_INLINE;
+#else
+    buffer = (struct lwcan_buffer *)lwcan_malloc_owner(sizeof(struct lwcan_buffer), LWCAN_MEM_OWNER_BUFFER, LWCAN_MEM_CLASS_HEADER);
 
     if (buffer == NULL)
     {
@@ -26,7 +121,7 @@ struct lwcan_buffer *lwcan_buffer_new(uint32_t length)
         return NULL;
     }
 
-    buffer->payload = (uint8_t *)lwcan_malloc(length);
+    buffer->payload = (uint8_t *)lwcan_malloc_owner(length, owner, LWCAN_MEM_CLASS_PAYLOAD);
 
     if (buffer->payload == NULL)
     {
@@ -37,36 +132,426 @@ struct lwcan_buffer *lwcan_buffer_new(uint32_t length)
         return NULL;
     }
 
+    buffer->type = LWCAN_BUFFER_TYPE_HEAP;
+#endif
+
+    buffer->next = NULL;
+
+    buffer->segment = NULL;
+
     buffer->length = length;
 
+    buffer->segment_length = length;
+
+    buffer->ref = 1;
+
     return buffer;
 }
 
-void lwcan_buffer_delete(struct lwcan_buffer *buffer)
+struct lwcan_buffer *lwcan_buffer_alloc(uint32_t length, lwcan_mem_owner_t owner)
+{
+#if LWCAN_BUFFER_SEGMENT_SIZE > 0
+    struct lwcan_buffer *buffer;
+
+    struct lwcan_buffer *segment;
+
+    struct lwcan_buffer *last;
+
+    uint32_t remaining;
+
+    uint32_t segment_length;
+#endif
+
+    if (length == 0)
+    {
+        LWCAN_ASSERT("length != 0", length != 0);
+
+        return NULL;
+    }
+
+#if LWCAN_BUFFER_SEGMENT_SIZE > 0
+    buffer = NULL;
+
+    last = NULL;
+
+    remaining = length;
+
+    while (remaining > 0)
+    {
+        segment_length = (remaining > LWCAN_BUFFER_SEGMENT_SIZE) ? LWCAN_BUFFER_SEGMENT_SIZE : remaining;
+
+        segment = buffer_alloc_segment(segment_length, owner);
+
+        if (segment == NULL)
+        {
+            if (buffer != NULL)
+            {
+                buffer_free(buffer);
+            }
+
+            return NULL;
+        }
+
+        /* Like the first segment, every segment knows the length up to the end of the chain */
+        segment->length = remaining;
+
+        if (last == NULL)
+        {
+            buffer = segment;
+        }
+        else
+        {
+            last->segment = segment;
+        }
+
+        last = segment;
+
+        remaining -= segment_length;
+    }
+
+    return buffer;
+#else
+    return buffer_alloc_segment(length, owner);
+#endif
+}
+
+struct lwcan_buffer *lwcan_buffer_alloc_ref(const uint8_t *data, uint32_t length, lwcan_buffer_release_function release, void *release_arg, lwcan_mem_owner_t owner)
 {
-    lwcan_free(buffer->payload);
+    struct lwcan_buffer_ref *ref;
+
+    if (data == NULL || length == 0)
+    {
+        LWCAN_ASSERT("data != NULL", data != NULL);
+        LWCAN_ASSERT("length != 0", length != 0);
+
+        return NULL;
+    }
+
+    ref = (struct lwcan_buffer_ref *)lwcan_malloc_owner(sizeof(struct lwcan_buffer_ref), owner, LWCAN_MEM_CLASS_HEADER);
+
+    if (ref == NULL)
+    {
+        LWCAN_ASSERT("ref != NULL", ref != NULL);
+
+        return NULL;
+    }
+
+    /* The payload is only read from, it is never written through a reference buffer */
+    ref->buffer.payload = (uint8_t *)data;
 
-    lwcan_free(buffer);
+    ref->buffer.type = LWCAN_BUFFER_TYPE_REF;
+
+    ref->buffer.next = NULL;
+
+    ref->buffer.segment = NULL;
+
+    ref->buffer.length = length;
+
+    ref->buffer.segment_length = length;
+
+    ref->buffer.ref = 1;
+
+    ref->release = release;
+
+    ref->release_arg = release_arg;
+
+    return &ref->buffer;
 }
 
-lwcanerr_t lwcan_buffer_copy_to(struct lwcan_buffer *buffer, const uint8_t *source, uint32_t length)
+struct lwcan_buffer *lwcan_buffer_alloc_posted(uint8_t *data, uint32_t length, lwcan_buffer_release_function release, void *release_arg)
 {
-    if (buffer == NULL || source == NULL || length == 0)
+#if LWCAN_BUFFER_POSTED_NUM > 0
+    struct lwcan_buffer_ref *ref;
+
+    if (data == NULL || length == 0)
     {
-        LWCAN_ASSERT("buffer != NULL", buffer != NULL);
-        LWCAN_ASSERT("source != NULL", source != NULL);
+        LWCAN_ASSERT("data != NULL", data != NULL);
         LWCAN_ASSERT("length != 0", length != 0);
 
+        return NULL;
+    }
+
+    ref = (struct lwcan_buffer_ref *)lwcan_memp_malloc(LWCAN_MEMP_BUFFER_POSTED);
+
+    if (ref == NULL)
+    {
+        return NULL;
+    }
+
+    ref->buffer.payload = data;
+
+    ref->buffer.type = LWCAN_BUFFER_TYPE_POSTED;
+
+    ref->buffer.next = NULL;
+
+    ref->buffer.segment = NULL;
+
+    ref->buffer.length = length;
+
+    ref->buffer.segment_length = length;
+
+    ref->buffer.ref = 1;
+
+    ref->release = release;
+
+    ref->release_arg = release_arg;
+
+    return &ref->buffer;
+#else
+    (void)data;
+    (void)length;
+    (void)release;
+    (void)release_arg;
+
+    return NULL;
+#endif
+}
+
+/* Resizes the payload of a heap segment, an inline segment can move so link is updated too */
+static lwcanerr_t buffer_resize_segment(struct lwcan_buffer **link, uint32_t length)
+{
+    struct lwcan_buffer *segment = *link;
+
+    uint8_t *payload;
+
+    if (segment->type == LWCAN_BUFFER_TYPE_HEAP)
+    {
+        payload = (uint8_t *)lwcan_realloc_class(segment->payload, length, LWCAN_MEM_CLASS_PAYLOAD);
+
+        if (payload == NULL)
+        {
+            return ERROR_MEMORY;
+        }
+
+        segment->payload = payload;
+    }
+    else
+    {
+        if ((BUFFER_HEADER_SIZE + (size_t)length) < (size_t)length)
+        {
+            return ERROR_MEMORY;
+        }
+
+        segment = (struct lwcan_buffer *)lwcan_realloc_class(segment, BUFFER_HEADER_SIZE + length, LWCAN_MEM_CLASS_PAYLOAD);
+
+        if (segment == NULL)
+        {
+            return ERROR_MEMORY;
+        }
+
+        segment->payload = (uint8_t *)segment + BUFFER_HEADER_SIZE;
+
+        *link = segment;
+    }
+
+    segment->segment_length = length;
+
+    return ERROR_OK;
+}
+
+lwcanerr_t lwcan_buffer_realloc(struct lwcan_buffer **buffer, uint32_t length, lwcan_mem_owner_t owner)
+{
+    struct lwcan_buffer **link;
+
+    struct lwcan_buffer *tail = NULL;
+
+    uint32_t offset = 0;
+
+    uint32_t segment_length;
+
+    lwcanerr_t ret;
+
+    if (buffer == NULL || *buffer == NULL || length == 0)
+    {
+        LWCAN_ASSERT("buffer != NULL", buffer != NULL && *buffer != NULL);
+        LWCAN_ASSERT("length != 0", length != 0);
+
+        return ERROR_ARG;
+    }
+
+    /* Only memory allocated by the stack can be resized */
+    if ((*buffer)->type != LWCAN_BUFFER_TYPE_HEAP && (*buffer)->type != LWCAN_BUFFER_TYPE_INLINE)
+    {
+        LWCAN_ASSERT("buffer is allocated from the heap", 0);
+
+        return ERROR_ARG;
+    }
+
+    /* Others holding the message would be left with a stale pointer */
+    if ((*buffer)->ref != 1)
+    {
+        return ERROR_INPROGRESS;
+    }
+
+    /* Find the segment the new end of the message falls into */
+    link = buffer;
+
+    while ((*link)->segment != NULL && (offset + (*link)->segment_length) < length)
+    {
+        offset += (*link)->segment_length;
+
+        link = &(*link)->segment;
+    }
+
+    segment_length = length - offset;
+
+#if LWCAN_BUFFER_SEGMENT_SIZE > 0
+    /* The last segment is grown up to the segment size, the rest is appended as new segments */
+    if (segment_length > LWCAN_BUFFER_SEGMENT_SIZE && segment_length > (*link)->segment_length)
+    {
+        if (LWCAN_BUFFER_SEGMENT_SIZE > (*link)->segment_length)
+        {
+            segment_length = LWCAN_BUFFER_SEGMENT_SIZE;
+        }
+        else
+        {
+            segment_length = (*link)->segment_length;
+        }
+
+        tail = lwcan_buffer_alloc(length - offset - segment_length, owner);
+
+        if (tail == NULL)
+        {
+            return ERROR_MEMORY;
+        }
+    }
+#else
+    (void)owner;
+#endif
+
+    if (segment_length != (*link)->segment_length)
+    {
+        ret = buffer_resize_segment(link, segment_length);
+
+        if (ret != ERROR_OK)
+        {
+            if (tail != NULL)
+            {
+                buffer_free(tail);
+            }
+
+            /* A segment which could not be shrunk in place keeps its memory */
+            if (segment_length > (*link)->segment_length)
+            {
+                return ret;
+            }
+
+            (*link)->segment_length = segment_length;
+        }
+    }
+
+    /* Segments past the new end are dropped, new ones are linked in their place */
+    if ((*link)->segment != NULL)
+    {
+        buffer_free((*link)->segment);
+    }
+
+    (*link)->segment = tail;
+
+    /* Every segment knows the length up to the end of the chain */
+    offset = length;
+
+    for (struct lwcan_buffer *segment = *buffer; segment != NULL; segment = segment->segment)
+    {
+        segment->length = offset;
+
+        offset -= segment->segment_length;
+    }
+
+    return ERROR_OK;
+}
+
+/*
+ * Changes the length of a message allocated with lwcan_buffer_new(), keeping its contents.
+ * The payload is grown into free memory behind it when possible, otherwise it is moved,
+ * so *buffer may change. On failure the message is left as it was.
+ */
+lwcanerr_t lwcan_buffer_resize(struct lwcan_buffer **buffer, uint32_t length)
+{
+    return lwcan_buffer_realloc(buffer, length, LWCAN_MEM_OWNER_APP);
+}
+
+/* Same as lwcan_buffer_unref(), the message is freed when the last reference is dropped */
+void lwcan_buffer_delete(struct lwcan_buffer *buffer)
+{
+    lwcan_buffer_unref(buffer);
+}
+
+lwcanerr_t lwcan_buffer_ref(struct lwcan_buffer *buffer)
+{
+    if (buffer == NULL)
+    {
+        LWCAN_ASSERT("buffer != NULL", buffer != NULL);
+
+        return ERROR_ARG;
+    }
+
+    if (buffer->type == LWCAN_BUFFER_TYPE_VIEW)
+    {
+        LWCAN_ASSERT("a view is not kept past the callback it is passed to", 0);
+
+        return ERROR_ARG;
+    }
+
+    if (buffer->ref == UINT8_MAX)
+    {
+        LWCAN_ASSERT("buffer->ref < UINT8_MAX", buffer->ref < UINT8_MAX);
+
         return ERROR_ARG;
     }
 
-    memcpy(buffer->payload, source, length);
+    buffer->ref += 1;
 
     return ERROR_OK;
 }
 
+void lwcan_buffer_unref(struct lwcan_buffer *buffer)
+{
+    if (buffer == NULL)
+    {
+        LWCAN_ASSERT("buffer != NULL", buffer != NULL);
+
+        return;
+    }
+
+    LWCAN_ASSERT("buffer->ref != 0", buffer->ref != 0);
+
+    if (buffer->ref > 1)
+    {
+        buffer->ref -= 1;
+
+        return;
+    }
+
+    buffer->ref = 0;
+
+    buffer_free(buffer);
+}
+
+/* Find the segment holding the offset and make the offset relative to it */
+static struct lwcan_buffer *buffer_seek(struct lwcan_buffer *buffer, uint32_t *offset)
+{
+    while (buffer != NULL && *offset >= buffer->segment_length)
+    {
+        *offset -= buffer->segment_length;
+
+        buffer = buffer->segment;
+    }
+
+    return buffer;
+}
+
+lwcanerr_t lwcan_buffer_copy_to(struct lwcan_buffer *buffer, const uint8_t *source, uint32_t length)
+{
+    return lwcan_buffer_copy_to_offset(buffer, source, length, 0);
+}
+
 lwcanerr_t lwcan_buffer_copy_to_offset(struct lwcan_buffer *buffer, const uint8_t *source, uint32_t length, uint32_t offset)
 {
+    struct lwcan_buffer *segment;
+
+    uint32_t chunk;
+
     if (buffer == NULL || source == NULL || length == 0)
     {
         LWCAN_ASSERT("buffer != NULL", buffer != NULL);
@@ -76,13 +561,57 @@ lwcanerr_t lwcan_buffer_copy_to_offset(struct lwcan_buffer *buffer, const uint8_
         return ERROR_ARG;
     }
 
-    memcpy(buffer->payload + offset, source, length);
+    if (length > buffer->length || offset > (buffer->length - length))
+    {
+        LWCAN_ASSERT("offset + length <= buffer->length", 0);
+
+        return ERROR_ARG;
+    }
+
+    /* The payload of these belongs to the caller or to a frame, it is only read through the buffer */
+    if (buffer->type == LWCAN_BUFFER_TYPE_REF || buffer->type == LWCAN_BUFFER_TYPE_VIEW)
+    {
+        LWCAN_ASSERT("buffer is writable", 0);
+
+        return ERROR_ARG;
+    }
+
+    segment = buffer_seek(buffer, &offset);
+
+    while (length > 0)
+    {
+        chunk = segment->segment_length - offset;
+
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+
+        memcpy(segment->payload + offset, source, chunk);
+
+        source += chunk;
+
+        length -= chunk;
+
+        offset = 0;
+
+        segment = segment->segment;
+    }
 
     return ERROR_OK;
 }
 
 lwcanerr_t lwcan_buffer_copy_from(struct lwcan_buffer *buffer, uint8_t *distination, uint32_t length)
 {
+    return lwcan_buffer_copy_from_offset(buffer, distination, length, 0);
+}
+
+lwcanerr_t lwcan_buffer_copy_from_offset(struct lwcan_buffer *buffer, uint8_t *distination, uint32_t length, uint32_t offset)
+{
+    struct lwcan_buffer *segment;
+
+    uint32_t chunk;
+
     if (buffer == NULL || distination == NULL || length == 0)
     {
         LWCAN_ASSERT("buffer != NULL", buffer != NULL);
@@ -92,23 +621,64 @@ lwcanerr_t lwcan_buffer_copy_from(struct lwcan_buffer *buffer, uint8_t *distinat
         return ERROR_ARG;
     }
 
-    memcpy(distination, buffer->payload, length);
+    if (length > buffer->length || offset > (buffer->length - length))
+    {
+        LWCAN_ASSERT("offset + length <= buffer->length", 0);
+
+        return ERROR_ARG;
+    }
+
+    segment = buffer_seek(buffer, &offset);
+
+    while (length > 0)
+    {
+        chunk = segment->segment_length - offset;
+
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+
+        memcpy(distination, segment->payload + offset, chunk);
+
+        distination += chunk;
+
+        length -= chunk;
+
+        offset = 0;
+
+        segment = segment->segment;
+    }
 
     return ERROR_OK;
 }
 
-lwcanerr_t lwcan_buffer_copy_from_offset(struct lwcan_buffer *buffer, uint8_t *distination, uint32_t length, uint32_t offset)
+uint16_t lwcan_buffer_get_iov(struct lwcan_buffer *buffer, struct lwcan_buffer_iov *iov, uint16_t iov_num)
 {
-    if (buffer == NULL || distination == NULL || length == 0)
+    uint16_t num;
+
+    if (buffer == NULL || (iov == NULL && iov_num != 0))
     {
         LWCAN_ASSERT("buffer != NULL", buffer != NULL);
-        LWCAN_ASSERT("distination != NULL", distination != NULL);
-        LWCAN_ASSERT("length != 0", length != 0);
+        LWCAN_ASSERT("iov != NULL", iov != NULL);
 
-        return ERROR_ARG;
+        return 0;
     }
 
-    memcpy(distination, buffer->payload + offset, length);
+    num = 0;
 
-    return ERROR_OK;
+    /* Segments which do not fit are still counted, so the caller can learn how many entries it needs */
+    for (; buffer != NULL; buffer = buffer->segment)
+    {
+        if (num < iov_num)
+        {
+            iov[num].base = buffer->payload;
+
+            iov[num].length = buffer->segment_length;
+        }
+
+        num++;
+    }
+
+    return num;
 }
@@ -7,12 +7,96 @@
 
 #include <string.h>
 
-#define MAX_CANIF_NUM 254
+#if CANIF_MAX_NUM < 1 || CANIF_MAX_NUM > 254
+#error "CANIF_MAX_NUM must be between 1 and 254"
+#endif
+
+/* Open addressing with linear probing, kept at most half full */
+#define CANIF_NAME_SLOTS (2 * CANIF_MAX_NUM)
 
 static struct canif *canif_list = NULL;
 
 static uint8_t canif_num = 0;
 
+/* Interfaces by num, canif_get_index() - 1 */
+static struct canif *canif_table[CANIF_MAX_NUM];
+
+/* num + 1 of the interfaces by hash of their name, 0 for a free slot */
+static uint8_t canif_names[CANIF_NAME_SLOTS];
+
+/* Names shorter than canif->name are padded with zeros */
+static uint32_t canif_name_key(const char *name)
+{
+    uint8_t key[4] = {0};
+
+    uint32_t word;
+
+    for (uint8_t i = 0; i < sizeof(key) && name[i] != '\0'; i++)
+    {
+        key[i] = (uint8_t)name[i];
+    }
+
+    memcpy(&word, key, sizeof(word));
+
+    return word;
+}
+
+static uint16_t canif_name_slot(uint32_t key)
+{
+    return (uint16_t)(((key * 2654435761U) >> 16) % CANIF_NAME_SLOTS);
+}
+
+static void canif_names_insert(struct canif *canif)
+{
+    uint16_t slot;
+
+    slot = canif_name_slot(canif_name_key(canif->name));
+
+    while (canif_names[slot] != 0)
+    {
+        slot = (uint16_t)((slot + 1) % CANIF_NAME_SLOTS);
+    }
+
+    canif_names[slot] = (uint8_t)(canif->num + 1);
+}
+
+static void canif_names_remove(struct canif *canif)
+{
+    uint16_t slot, next, home;
+
+    slot = canif_name_slot(canif_name_key(canif->name));
+
+    while (canif_names[slot] != (uint8_t)(canif->num + 1))
+    {
+        slot = (uint16_t)((slot + 1) % CANIF_NAME_SLOTS);
+    }
+
+    /* Move later entries of the probe sequence back, so lookups need no tombstones */
+    next = slot;
+
+    while (1)
+    {
+        next = (uint16_t)((next + 1) % CANIF_NAME_SLOTS);
+
+        if (canif_names[next] == 0)
+        {
+            break;
+        }
+
+        home = canif_name_slot(canif_name_key(canif_table[canif_names[next] - 1]->name));
+
+        /* The entry at next may only move to slot if slot lies between its home and next */
+        if ((slot < next) ? (home <= slot || home > next) : (home <= slot && home > next))
+        {
+            canif_names[slot] = canif_names[next];
+
+            slot = next;
+        }
+    }
+
+    canif_names[slot] = 0;
+}
+
 static lwcanerr_t canif_input(struct canif *canif, void *frame)
 {
 #if LWCAN_RAW
@@ -41,11 +125,50 @@ static lwcanerr_t canif_input(struct canif *canif, void *frame)
     return ERROR_OK;
 }
 
-lwcanerr_t canif_add(struct canif *canif, const char *name, canif_init_function init)
+static lwcanerr_t canif_input_batch(struct canif *canif, void *frames, uint8_t frame_size, uint16_t count)
 {
-    struct canif *canif_temp;
+    uint8_t *frame;
+
+#if LWCAN_ISOTP
+    uint8_t if_index;
+
+    struct isotp_input_hint hint = {NULL, 0};
+#endif
+
+    if (canif == NULL || frames == NULL || frame_size == 0)
+    {
+        LWCAN_ASSERT("canif != NULL", canif != NULL);
+        LWCAN_ASSERT("frames != NULL", frames != NULL);
+        LWCAN_ASSERT("frame_size != 0", frame_size != 0);
+
+        return ERROR_ARG;
+    }
 
-    uint8_t num_canifs;
+#if LWCAN_ISOTP
+    if_index = canif_get_index(canif);
+#endif
+
+    /* Frames ISO-TP answers with are sent through lwcan_defer(), so after the whole batch */
+    for (frame = (uint8_t *)frames; count > 0; count--, frame += frame_size)
+    {
+#if LWCAN_RAW
+        if (canraw_input(canif, frame) == RAW_INPUT_EATEN)
+        {
+            continue;
+        }
+#endif
+
+#if LWCAN_ISOTP
+        isotp_input_hinted(if_index, frame, &hint);
+#endif
+    }
+
+    return ERROR_OK;
+}
+
+lwcanerr_t canif_add(struct canif *canif, const char *name, canif_init_function init)
+{
+    uint8_t num;
 
     if (canif == NULL || name == NULL || strlen(name) == 0 || strlen(name) > sizeof(canif->name) || init == NULL)
     {
@@ -58,60 +181,46 @@ lwcanerr_t canif_add(struct canif *canif, const char *name, canif_init_function
         return ERROR_ARG;
     }
 
-    memset(canif, 0, sizeof(struct canif));
-
-    memcpy(canif->name, name, strlen(name));
-
-    canif->input = canif_input;
-
-    canif->num = canif_num;
-
-    if (init(canif) != ERROR_OK)
+    /* An added interface is in the table under its num */
+    if (canif->num < CANIF_MAX_NUM && canif_table[canif->num] == canif)
     {
-        return ERROR_IF;
+        return ERROR_CANIF;
     }
 
-    do
+    /* Numbers are handed out in turn, so the index of a removed interface is not reused right away */
+    num = canif_num;
+
+    while (canif_table[num] != NULL)
     {
-        if (canif->num == MAX_CANIF_NUM)
+        num = (uint8_t)((num + 1) % CANIF_MAX_NUM);
+
+        if (num == canif_num)
         {
-            canif->num = 0;
+            return ERROR_CANIF_MAX;
         }
+    }
 
-        num_canifs = 0;
-
-        for (canif_temp = canif_list; canif_temp != NULL; canif_temp = canif_temp->next)
-        {
-            if (canif_temp == canif)
-            {
-                return ERROR_CANIF;
-            }
+    memset(canif, 0, sizeof(struct canif));
 
-            num_canifs++;
+    memcpy(canif->name, name, strlen(name));
 
-            if (num_canifs >= MAX_CANIF_NUM)
-            {
-                return ERROR_CANIF_MAX;
-            }
+    canif->input = canif_input;
 
-            if (canif_temp->num == canif->num)
-            {
-                canif->num++;
+    canif->input_batch = canif_input_batch;
 
-                break;
-            }
-        }
-    } while (canif_temp != NULL);
+    canif->num = num;
 
-    if (canif->num == (MAX_CANIF_NUM - 1))
-    {
-        canif_num = 0;
-    }
-    else
+    if (init(canif) != ERROR_OK)
     {
-        canif_num = (uint8_t)(canif->num + 1);
+        return ERROR_IF;
     }
 
+    canif_num = (uint8_t)((num + 1) % CANIF_MAX_NUM);
+
+    canif_table[num] = canif;
+
+    canif_names_insert(canif);
+
     canif->next = canif_list;
 
     canif_list = canif;
@@ -130,6 +239,15 @@ lwcanerr_t canif_remove(struct canif *canif)
         return ERROR_ARG;
     }
 
+    if (canif->num >= CANIF_MAX_NUM || canif_table[canif->num] != canif)
+    {
+        return ERROR_CANIF;
+    }
+
+    canif_names_remove(canif);
+
+    canif_table[canif->num] = NULL;
+
     if (canif_list == canif)
     {
         canif_list = canif->next;
@@ -202,6 +320,10 @@ struct canif *canif_get_by_name(const char *name)
 {
     struct canif *canif;
 
+    uint32_t key;
+
+    uint16_t slot;
+
     if (name == NULL)
     {
         LWCAN_ASSERT("name != NULL", name != NULL);
@@ -209,15 +331,19 @@ struct canif *canif_get_by_name(const char *name)
         return NULL;
     }
 
-    for (canif = canif_list; canif != NULL; canif = canif->next)
+    key = canif_name_key(name);
+
+    for (slot = canif_name_slot(key); canif_names[slot] != 0; slot = (uint16_t)((slot + 1) % CANIF_NAME_SLOTS))
     {
-        if (memcmp(canif->name, name, sizeof(canif->name)) == 0)
+        canif = canif_table[canif_names[slot] - 1];
+
+        if (canif_name_key(canif->name) == key)
         {
-            break;
+            return canif;
         }
     }
 
-    return canif;
+    return NULL;
 }
 
 uint8_t canif_name_to_index(const char *name)
@@ -250,8 +376,6 @@ uint8_t canif_get_index(struct canif *canif)
 
 struct canif *canif_get_by_index(uint8_t index)
 {
-    struct canif *canif;
-
     if (index == 0)
     {
         LWCAN_ASSERT("index != 0", index != 0);
@@ -259,13 +383,10 @@ struct canif *canif_get_by_index(uint8_t index)
         return NULL;
     }
 
-    for (canif = canif_list; canif != NULL; canif = canif->next)
+    if (index > CANIF_MAX_NUM)
     {
-        if (index == canif_get_index(canif))
-        {
-            break;
-        }
+        return NULL;
     }
 
-    return canif;
+    return canif_table[index - 1];
 }
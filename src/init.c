@@ -3,9 +3,12 @@
 #include "lwcan/private/isotp_private.h"
 #include "lwcan/private/raw_private.h"
 #include "lwcan/private/timeouts_private.h"
+#include "lwcan/private/memp_private.h"
 
 void lwcan_init(void)
 {
+    lwcan_memp_init();
+
 #if LWCAN_ISOTP
     isotp_init();
 #endif
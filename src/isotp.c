@@ -4,29 +4,21 @@
 
 #include "lwcan/isotp.h"
 #include "lwcan/private/isotp_private.h"
+#include "lwcan/private/memp_private.h"
+#include "lwcan/private/buffer_private.h"
+#include "lwcan/memory.h"
 #include "lwcan/timeouts.h"
 #include "lwcan/debug.h"
 
 #include <string.h>
 
-#define ISOTP_MEM_CHUNK_SIZE sizeof(struct isotp_pcb)
-
-#define ISOTP_MEM_POOL_SIZE (ISOTP_MEM_CHUNK_SIZE * ISOTP_MAX_PCB_NUM)
-
-#define ISOTP_MEM_POOL_BEGIN_ADDR (uint8_t *)(&isotp_mem_pool[0])
-
-#define ISOTP_MEM_POOL_END_ADDR (uint8_t *)(&isotp_mem_pool[ISOTP_MEM_POOL_SIZE - 1])
-
-#define ISOTP_MEM_POOL_SERVICE_BEGIN_IDX ISOTP_MEM_POOL_SIZE
-
-#define ISOTP_MEM_POOL_SERVICE_END_IDX ((ISOTP_MEM_POOL_SIZE + ISOTP_MAX_PCB_NUM) - 1)
-
-static uint8_t isotp_mem_pool[ISOTP_MEM_POOL_SIZE + ISOTP_MAX_PCB_NUM];
-
 static struct isotp_pcb *isotp_pcb_list;
 
 static uint8_t isotp_pcb_num;
 
+/* Changed whenever a PCB is added, bound or removed, so cached PCB pointers can be checked */
+static uint16_t isotp_pcb_list_version;
+
 #if ISOTP_CANFD
 static const uint8_t padding_length[] = {
     8, 8, 8, 8, 8, 8, 8, 8, 8,      /* 0 - 8 */
@@ -40,53 +32,8 @@ static const uint8_t padding_length[] = {
 };
 #endif
 
-static void *isotp_pcb_malloc(void)
-{
-    for (uint16_t i = ISOTP_MEM_POOL_SERVICE_BEGIN_IDX; i <= ISOTP_MEM_POOL_SERVICE_END_IDX; i++)
-    {
-        if (isotp_mem_pool[i] == 0)
-        {
-            isotp_mem_pool[i] = 0xAA;
-
-            return (void *)&isotp_mem_pool[(i - ISOTP_MEM_POOL_SERVICE_BEGIN_IDX) * ISOTP_MEM_CHUNK_SIZE];
-        }
-    }
-
-    return NULL;
-}
-
-static void isotp_pcb_free(void *mem)
-{
-    uint16_t idx;
-
-    uint8_t addr;
-
-    /* Checking an address for inclusion in a memory pool */
-    if (mem == NULL || (uint8_t *)mem < ISOTP_MEM_POOL_BEGIN_ADDR || (uint8_t *)mem > ISOTP_MEM_POOL_END_ADDR)
-    {
-        return;
-    }
-
-    /* get address within memory pool */
-    addr = (uint8_t *)mem - ISOTP_MEM_POOL_BEGIN_ADDR;
-
-    /* check address for multiple of chunk size */
-    if ((addr % ISOTP_MEM_CHUNK_SIZE) != 0)
-    {
-        return;
-    }
-
-    /* get the index of the element which means that the chunk has been allocated */
-    idx = ISOTP_MEM_POOL_SERVICE_BEGIN_IDX + (addr / ISOTP_MEM_CHUNK_SIZE);
-
-    /* freeing the chunk */
-    isotp_mem_pool[idx] = 0;
-}
-
 void isotp_init(void)
 {
-    memset(isotp_mem_pool, 0, sizeof(isotp_mem_pool));
-
     isotp_pcb_list = NULL;
 
     isotp_pcb_num = 0;
@@ -103,7 +50,7 @@ struct isotp_pcb *isotp_new(void)
         return NULL;
     }
 
-    pcb = (struct isotp_pcb *)isotp_pcb_malloc();
+    pcb = (struct isotp_pcb *)lwcan_memp_malloc(LWCAN_MEMP_ISOTP_PCB);
 
     if (pcb == NULL)
     {
@@ -120,10 +67,20 @@ struct isotp_pcb *isotp_new(void)
 
     pcb->input_flow.pcb = pcb;
 
+    lwcan_timer_init(&pcb->output_flow.timer, isotp_output_error_handler, pcb);
+
+    lwcan_timer_init(&pcb->output_flow.output_timer, isotp_out_flow_output, pcb);
+
+    lwcan_timer_init(&pcb->input_flow.timer, isotp_input_error_handler, pcb);
+
+    lwcan_timer_init(&pcb->input_flow.output_timer, isotp_in_flow_output, pcb);
+
     isotp_pcb_list = pcb;
 
     isotp_pcb_num += 1;
 
+    isotp_pcb_list_version += 1;
+
     return pcb;
 }
 
@@ -182,6 +139,8 @@ lwcanerr_t isotp_bind(struct isotp_pcb *pcb, const struct addr_can *addr)
 
     pcb->rx_id = rx_id;
 
+    isotp_pcb_list_version += 1;
+
     return ERROR_OK;
 }
 
@@ -189,6 +148,8 @@ void isotp_remove(struct isotp_pcb *pcb)
 {
     struct isotp_pcb *pcb_temp;
 
+    struct lwcan_buffer *buffer;
+
     if (pcb == NULL)
     {
         return;
@@ -216,9 +177,45 @@ void isotp_remove(struct isotp_pcb *pcb)
         }
     }
 
-    isotp_pcb_free(pcb);
+    /* The timers live in the pcb, they must not fire after it is freed */
+    lwcan_timer_cancel(&pcb->output_flow.timer);
+
+    lwcan_timer_cancel(&pcb->output_flow.output_timer);
+
+    lwcan_timer_cancel(&pcb->input_flow.timer);
+
+    lwcan_timer_cancel(&pcb->input_flow.output_timer);
+
+    lwcan_undefer(isotp_out_flow_output, pcb);
+
+    lwcan_undefer(isotp_in_flow_output, pcb);
+
+    /* Posted receive buffers go back to the application */
+    while (pcb->rx_buffers != NULL)
+    {
+        buffer = pcb->rx_buffers;
+
+        pcb->rx_buffers = buffer->next;
+
+        lwcan_buffer_unref(buffer);
+    }
+
+    /* Messages still in the flows are aborted, REF buffers give their data back through release */
+    while (pcb->output_flow.buffer != NULL)
+    {
+        isotp_remove_buffer(&pcb->output_flow, pcb->output_flow.buffer);
+    }
+
+    while (pcb->input_flow.buffer != NULL)
+    {
+        isotp_remove_buffer(&pcb->input_flow, pcb->input_flow.buffer);
+    }
+
+    lwcan_memp_free(LWCAN_MEMP_ISOTP_PCB, pcb);
 
     isotp_pcb_num -= 1;
+
+    isotp_pcb_list_version += 1;
 }
 
 lwcanerr_t isotp_set_receive_callback(struct isotp_pcb *pcb, isotp_receive_function receive)
@@ -249,6 +246,27 @@ lwcanerr_t isotp_set_receive_ff_callback(struct isotp_pcb *pcb, isotp_receive_ff
     return ERROR_OK;
 }
 
+lwcanerr_t isotp_set_receive_block_callback(struct isotp_pcb *pcb, isotp_receive_block_function receive_block, isotp_receive_done_function receive_done)
+{
+    if (pcb == NULL)
+    {
+        LWCAN_ASSERT("pcb != NULL", pcb != NULL);
+
+        return ERROR_ARG;
+    }
+
+    if (pcb->input_flow.state != ISOTP_IDLE)
+    {
+        return ERROR_INPROGRESS;
+    }
+
+    pcb->receive_block = receive_block;
+
+    pcb->receive_done = receive_done;
+
+    return ERROR_OK;
+}
+
 lwcanerr_t isotp_set_sent_callback(struct isotp_pcb *pcb, isotp_sent_function sent)
 {
     if (pcb == NULL)
@@ -291,11 +309,116 @@ lwcanerr_t isotp_set_callback_arg(struct isotp_pcb *pcb, void *arg)
     return ERROR_OK;
 }
 
+lwcanerr_t isotp_set_mem_limits(struct isotp_pcb *pcb, uint32_t reserved, uint32_t quota)
+{
+    if (pcb == NULL || (quota != 0 && reserved > quota))
+    {
+        LWCAN_ASSERT("pcb != NULL", pcb != NULL);
+        LWCAN_ASSERT("reserved <= quota", quota == 0 || reserved <= quota);
+
+        return ERROR_ARG;
+    }
+
+    pcb->mem_reserved = reserved;
+
+    pcb->mem_quota = quota;
+
+    return ERROR_OK;
+}
+
+/* Reserved memory the other pcbs have not used yet */
+static uint32_t mem_reserved_by_others(struct isotp_pcb *pcb)
+{
+    struct isotp_pcb *pcb_temp;
+
+    uint32_t reserved;
+
+    reserved = 0;
+
+    for (pcb_temp = isotp_pcb_list; pcb_temp != NULL; pcb_temp = pcb_temp->next)
+    {
+        if (pcb_temp != pcb && pcb_temp->mem_reserved > pcb_temp->mem_used)
+        {
+            reserved += pcb_temp->mem_reserved - pcb_temp->mem_used;
+        }
+    }
+
+    return reserved;
+}
+
+static uint8_t mem_take(struct isotp_pcb *pcb, uint32_t length)
+{
+    uint32_t own;
+
+    uint32_t others;
+
+    if (pcb->mem_quota != 0 && (length > pcb->mem_quota || pcb->mem_used > (pcb->mem_quota - length)))
+    {
+        return 0;
+    }
+
+    own = (pcb->mem_reserved > pcb->mem_used) ? (pcb->mem_reserved - pcb->mem_used) : 0;
+
+    /* What the own reservation does not cover must leave the reservations of the others untouched */
+    if (length > own)
+    {
+        others = mem_reserved_by_others(pcb);
+
+        /* Message data comes from the payload class, only its free space can honour the reservations */
+        if (others != 0)
+        {
+            if (((uint64_t)length - own + others) > lwcan_mem_get_free_size(LWCAN_MEM_CLASS_PAYLOAD))
+            {
+                return 0;
+            }
+        }
+    }
+
+    pcb->mem_used += length;
+
+    return 1;
+}
+
+/* Only buffers with heap payload count against the limits of a pcb */
+static uint32_t mem_charge(struct lwcan_buffer *buffer)
+{
+    if (buffer->type == LWCAN_BUFFER_TYPE_HEAP || buffer->type == LWCAN_BUFFER_TYPE_INLINE)
+    {
+        return buffer->length;
+    }
+
+    return 0;
+}
+
+struct lwcan_buffer *isotp_buffer_alloc(struct isotp_pcb *pcb, uint32_t length, lwcan_mem_owner_t owner)
+{
+    struct lwcan_buffer *buffer;
+
+    if (!mem_take(pcb, length))
+    {
+        return NULL;
+    }
+
+    buffer = lwcan_buffer_alloc(length, owner);
+
+    if (buffer == NULL)
+    {
+        pcb->mem_used -= length;
+    }
+
+    return buffer;
+}
+
 struct isotp_pcb *isotp_get_pcb_list(void)
 {
     return isotp_pcb_list;
 }
 
+uint16_t isotp_get_pcb_list_version(void)
+{
+    return isotp_pcb_list_version;
+}
+
 uint8_t isotp_get_sf_dl(uint8_t *frame_data)
 {
     uint8_t length = 0;
@@ -321,13 +444,13 @@ uint32_t isotp_get_ff_dl(uint8_t *frame_data)
 #if ISOTP_CANFD
     if (frame_data[FD_FF_FLAG_OFFSET] == FD_FF_FLAG)
     {
-        length = frame_data[FD_FF_DL_OFFSET] << 24;
+        length = (uint32_t)frame_data[FD_FF_DL_OFFSET] << 24;
 
-        length = frame_data[FD_FF_DL_OFFSET + 1] << 16;
+        length |= (uint32_t)frame_data[FD_FF_DL_OFFSET + 1] << 16;
 
-        length = frame_data[FD_FF_DL_OFFSET + 2] << 8;
+        length |= (uint32_t)frame_data[FD_FF_DL_OFFSET + 2] << 8;
 
-        length = frame_data[FD_FF_DL_OFFSET + 3];
+        length |= frame_data[FD_FF_DL_OFFSET + 3];
     }
     else
 #endif
@@ -357,23 +480,24 @@ static inline void add_padding(uint8_t *data, uint8_t num)
     memset(data, ISOTP_PADDING_BYTE, num);
 }
 
-void isotp_fill_sf(struct isotp_flow *flow, void *frame)
+/* Sets the length, protocol control information and padding of a single frame, returns where its data goes */
+static uint8_t *prepare_sf(void *frame, uint8_t length)
 {
 #if ISOTP_CANFD
     struct canfd_frame *_frame = (struct canfd_frame *)frame;
 
-    _frame->len = get_padding_length(flow->remaining_data);
+    _frame->len = get_padding_length(FD_SF_DATA_OFFSET + length);
 
     _frame->data[FRAME_TYPE_OFFSET] = SF;
 
-    _frame->data[FD_SF_DL_OFFSET] = (flow->remaining_data & FD_SF_DL_MASK);
-
-    lwcan_buffer_copy_from(flow->buffer, (_frame->data + FD_SF_DATA_OFFSET), flow->remaining_data);
+    _frame->data[FD_SF_DL_OFFSET] = (length & FD_SF_DL_MASK);
 
-    if (flow->remaining_data < (uint8_t)(_frame->len - FD_SF_DATA_OFFSET))
+    if (length < (uint8_t)(_frame->len - FD_SF_DATA_OFFSET))
     {
-        add_padding((_frame->data + FD_SF_DATA_OFFSET + flow->remaining_data), (_frame->len - (FD_SF_DATA_OFFSET + flow->remaining_data)));
+        add_padding((_frame->data + FD_SF_DATA_OFFSET + length), (_frame->len - (FD_SF_DATA_OFFSET + length)));
     }
+
+    return _frame->data + FD_SF_DATA_OFFSET;
 #else
     struct can_frame *_frame = (struct can_frame *)frame;
 
@@ -381,19 +505,33 @@ void isotp_fill_sf(struct isotp_flow *flow, void *frame)
 
     _frame->data[FRAME_TYPE_OFFSET] = SF;
 
-    _frame->data[SF_DL_OFFSET] |= (flow->remaining_data & SF_DL_MASK);
-
-    lwcan_buffer_copy_from(flow->buffer, (_frame->data + SF_DATA_OFFSET), flow->remaining_data);
+    _frame->data[SF_DL_OFFSET] |= (length & SF_DL_MASK);
 
-    if (flow->remaining_data < (uint8_t)(_frame->len - SF_DATA_OFFSET))
+    if (length < (uint8_t)(_frame->len - SF_DATA_OFFSET))
     {
-        add_padding((_frame->data + SF_DATA_OFFSET + flow->remaining_data), (_frame->len - (SF_DATA_OFFSET + flow->remaining_data)));
+        add_padding((_frame->data + SF_DATA_OFFSET + length), (_frame->len - (SF_DATA_OFFSET + length)));
     }
+
+    return _frame->data + SF_DATA_OFFSET;
 #endif
+}
+
+void isotp_fill_sf(struct isotp_flow *flow, void *frame)
+{
+    uint8_t *data;
+
+    data = prepare_sf(frame, (uint8_t)flow->remaining_data);
+
+    lwcan_buffer_copy_from(flow->buffer, data, flow->remaining_data);
 
     flow->remaining_data -= flow->remaining_data;
 }
 
+void isotp_encode_sf(void *frame, const uint8_t *data, uint8_t length)
+{
+    memcpy(prepare_sf(frame, length), data, length);
+}
+
 void isotp_fill_ff(struct isotp_flow *flow, void *frame)
 {
 #if ISOTP_CANFD
@@ -435,10 +573,14 @@ void isotp_fill_ff(struct isotp_flow *flow, void *frame)
 
 void isotp_fill_cf(struct isotp_flow *flow, void *frame)
 {
+    struct lwcan_buffer *segment;
+
+    uint32_t offset;
+
 #if ISOTP_CANFD
     struct canfd_frame *_frame = (struct canfd_frame *)frame;
 
-    _frame->len = get_padding_length(flow->remaining_data);
+    _frame->len = get_padding_length(CF_DATA_OFFSET + flow->remaining_data);
 #else
     struct can_frame *_frame = (struct can_frame *)frame;
 
@@ -449,9 +591,11 @@ void isotp_fill_cf(struct isotp_flow *flow, void *frame)
 
     _frame->data[CF_SN_OFFSET] |= (flow->cf_sn & CF_SN_MASK);
 
+    segment = isotp_flow_segment(flow, &offset);
+
     if (flow->remaining_data < (uint8_t)(_frame->len - CF_DATA_OFFSET))
     {
-        lwcan_buffer_copy_from_offset(flow->buffer, (_frame->data + CF_DATA_OFFSET), flow->remaining_data, (flow->buffer->length - flow->remaining_data));
+        lwcan_buffer_copy_from_offset(segment, (_frame->data + CF_DATA_OFFSET), flow->remaining_data, offset);
 
         add_padding((_frame->data + flow->remaining_data + CF_DATA_OFFSET), (_frame->len - (CF_DATA_OFFSET + flow->remaining_data)));
 
@@ -459,7 +603,7 @@ void isotp_fill_cf(struct isotp_flow *flow, void *frame)
     }
     else
     {
-        lwcan_buffer_copy_from_offset(flow->buffer, (_frame->data + CF_DATA_OFFSET), (_frame->len - CF_DATA_OFFSET), (flow->buffer->length - flow->remaining_data));
+        lwcan_buffer_copy_from_offset(segment, (_frame->data + CF_DATA_OFFSET), (_frame->len - CF_DATA_OFFSET), offset);
 
         flow->remaining_data -= (_frame->len - CF_DATA_OFFSET);
     }
@@ -489,6 +633,48 @@ void isotp_fill_fc(struct isotp_flow *flow, void *frame)
     }
 }
 
+/* Consecutive frames continue from the segment the previous one ended in, so a long chain is not walked from the start for every frame */
+struct lwcan_buffer *isotp_flow_segment(struct isotp_flow *flow, uint32_t *offset)
+{
+    *offset = flow->buffer->length - flow->remaining_data;
+
+    if (flow->segment == NULL || *offset < flow->segment_offset)
+    {
+        flow->segment = flow->buffer;
+
+        flow->segment_offset = 0;
+    }
+
+    while (flow->segment->segment != NULL && (*offset - flow->segment_offset) >= flow->segment->segment_length)
+    {
+        flow->segment_offset += flow->segment->segment_length;
+
+        flow->segment = flow->segment->segment;
+    }
+
+    *offset -= flow->segment_offset;
+
+    return flow->segment;
+}
+
+/* The next frame of a flow is sent from the deferred call queue, or from the flow's timer if the queue is full */
+void isotp_defer_output(struct isotp_flow *flow)
+{
+    lwcan_timeout_handler output;
+
+    output = (flow == &flow->pcb->output_flow) ? isotp_out_flow_output : isotp_in_flow_output;
+
+    /* A flow has at most one frame waiting to be sent */
+    lwcan_timer_cancel(&flow->output_timer);
+
+    lwcan_undefer(output, flow->pcb);
+
+    if (lwcan_defer(output, flow->pcb) != ERROR_OK)
+    {
+        lwcan_timer_arm(&flow->output_timer, 0);
+    }
+}
+
 void isotp_remove_buffer(struct isotp_flow *flow, struct lwcan_buffer *buffer)
 {
     struct lwcan_buffer *buffer_temp;
@@ -505,7 +691,9 @@ void isotp_remove_buffer(struct isotp_flow *flow, struct lwcan_buffer *buffer)
     {
         flow->buffer = flow->buffer->next;
 
-        lwcan_buffer_delete(buffer);
+        flow->pcb->mem_used -= mem_charge(buffer);
+
+        lwcan_buffer_unref(buffer);
     }
     else
     {
@@ -515,7 +703,9 @@ void isotp_remove_buffer(struct isotp_flow *flow, struct lwcan_buffer *buffer)
             {
                 buffer_temp->next = buffer->next;
 
-                lwcan_buffer_delete(buffer);
+                flow->pcb->mem_used -= mem_charge(buffer);
+
+                lwcan_buffer_unref(buffer);
 
                 break;
             }
@@ -559,7 +749,11 @@ void isotp_input_error_handler(void *arg)
 
     pcb = (struct isotp_pcb *)arg;
 
-    isotp_remove_buffer(&pcb->input_flow, pcb->input_flow.buffer);
+    /* A block held by the application is left for it to give back */
+    if (pcb->input_flow.state != ISOTP_WAIT_RECEIVED)
+    {
+        isotp_remove_buffer(&pcb->input_flow, pcb->input_flow.buffer);
+    }
 
     pcb->input_flow.state = ISOTP_IDLE;
 
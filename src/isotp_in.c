@@ -4,11 +4,50 @@
 
 #include "lwcan/isotp.h"
 #include "lwcan/private/isotp_private.h"
+#include "lwcan/private/buffer_private.h"
 #include "lwcan/timeouts.h"
 #include "lwcan/debug.h"
 
 #include <string.h>
 
+/* A posted buffer large enough for the message is used first, the heap is the fallback */
+static struct lwcan_buffer *alloc_rx_buffer(struct isotp_pcb *pcb, uint32_t length)
+{
+    struct lwcan_buffer *buffer;
+
+    struct lwcan_buffer *prev;
+
+    prev = NULL;
+
+    for (buffer = pcb->rx_buffers; buffer != NULL; buffer = buffer->next)
+    {
+        if (buffer->length >= length)
+        {
+            if (prev == NULL)
+            {
+                pcb->rx_buffers = buffer->next;
+            }
+            else
+            {
+                prev->next = buffer->next;
+            }
+
+            buffer->next = NULL;
+
+            buffer->length = length;
+
+            buffer->segment_length = length;
+
+            return buffer;
+        }
+
+        prev = buffer;
+    }
+
+    return isotp_buffer_alloc(pcb, length, LWCAN_MEM_OWNER_ISOTP_RX);
+}
+
+#if !ISOTP_SF_DIRECT
 static void store_sf_data(struct isotp_flow *flow, uint8_t *data, uint8_t length)
 {
     (void)length;
@@ -24,36 +63,50 @@ static void store_sf_data(struct isotp_flow *flow, uint8_t *data, uint8_t length
         lwcan_buffer_copy_to(flow->buffer, (data + SF_DATA_OFFSET), flow->remaining_data);
     }
 }
+#endif
 
-static void store_ff_data(struct isotp_flow *flow, uint8_t *data, uint8_t length)
+static uint8_t get_ff_data_offset(uint8_t *data)
 {
 #if ISOTP_CANFD
     if ((data[FD_FF_FLAG_OFFSET] & FD_FF_FLAG_MASK) == FD_FF_FLAG)
     {
-        lwcan_buffer_copy_to(flow->buffer, (data + FD_FF_DATA_OFFSET), (length - FD_FF_DATA_OFFSET));
-
-        flow->remaining_data -= (length - FD_FF_DATA_OFFSET);
+        return FD_FF_DATA_OFFSET;
     }
-    else
+#else
+    (void)data;
 #endif
-    {
-        lwcan_buffer_copy_to(flow->buffer, (data + FF_DATA_OFFSET), (length - FF_DATA_OFFSET));
 
-        flow->remaining_data -= (length - FF_DATA_OFFSET);
-    }
+    return FF_DATA_OFFSET;
+}
+
+static void store_ff_data(struct isotp_flow *flow, uint8_t *data, uint8_t length)
+{
+    uint8_t offset;
+
+    offset = get_ff_data_offset(data);
+
+    lwcan_buffer_copy_to(flow->buffer, (data + offset), (length - offset));
+
+    flow->remaining_data -= (length - offset);
 }
 
 static void store_cf_data(struct isotp_flow *flow, uint8_t *data, uint8_t length)
 {
+    struct lwcan_buffer *segment;
+
+    uint32_t offset;
+
+    segment = isotp_flow_segment(flow, &offset);
+
     if (flow->remaining_data < (uint8_t)(length - CF_DATA_OFFSET))
     {
-        lwcan_buffer_copy_to_offset(flow->buffer, (data + CF_DATA_OFFSET), flow->remaining_data, (flow->buffer->length - flow->remaining_data));
+        lwcan_buffer_copy_to_offset(segment, (data + CF_DATA_OFFSET), flow->remaining_data, offset);
 
         flow->remaining_data -= flow->remaining_data;
     }
     else
     {
-        lwcan_buffer_copy_to_offset(flow->buffer, (data + CF_DATA_OFFSET), (length - CF_DATA_OFFSET), (flow->buffer->length - flow->remaining_data));
+        lwcan_buffer_copy_to_offset(segment, (data + CF_DATA_OFFSET), (length - CF_DATA_OFFSET), offset);
 
         flow->remaining_data -= (length - CF_DATA_OFFSET);
     }
@@ -130,11 +183,58 @@ void isotp_in_flow_output(void *arg)
     }
 }
 
+#if ISOTP_SF_DIRECT
+/* The receive callback gets a view into the frame, so nothing is allocated for a single frame */
+static void received_sf_direct(struct isotp_pcb *pcb, uint8_t *data, uint8_t length)
+{
+    struct lwcan_buffer view;
+
+    if (pcb->receive == NULL)
+    {
+        return;
+    }
+
+    view.payload = data;
+
+    view.next = NULL;
+
+    view.segment = NULL;
+
+    view.length = length;
+
+    view.segment_length = length;
+
+    view.type = LWCAN_BUFFER_TYPE_VIEW;
+
+    view.ref = 1;
+
+    pcb->receive(pcb->callback_arg, pcb, &view);
+}
+#endif
+
+static uint8_t get_sf_data_offset(uint8_t *data)
+{
+#if ISOTP_CANFD
+    if ((data[FD_SF_FLAG_OFFSET] & FD_SF_FLAG_MASK) == FD_SF_FLAG)
+    {
+        return FD_SF_DATA_OFFSET;
+    }
+#else
+    (void)data;
+#endif
+
+    return SF_DATA_OFFSET;
+}
+
 static void received_sf(struct isotp_pcb *pcb, void *frame)
 {
     uint8_t length;
 
+    uint8_t offset;
+
+#if !ISOTP_SF_DIRECT
     struct lwcan_buffer *buffer;
+#endif
 
 #if ISOTP_CANFD
     struct canfd_frame *_frame = (struct canfd_frame *)frame;
@@ -149,7 +249,18 @@ static void received_sf(struct isotp_pcb *pcb, void *frame)
 
     length = isotp_get_sf_dl(_frame->data);
 
-    buffer = lwcan_buffer_new(length);
+    offset = get_sf_data_offset(_frame->data);
+
+    /* A data length the frame can not hold is malformed */
+    if (length == 0 || length > (_frame->len - offset))
+    {
+        return;
+    }
+
+#if ISOTP_SF_DIRECT
+    received_sf_direct(pcb, (_frame->data + offset), length);
+#else
+    buffer = alloc_rx_buffer(pcb, length);
 
     if (buffer == NULL)
     {
@@ -167,6 +278,8 @@ static void received_sf(struct isotp_pcb *pcb, void *frame)
 
     pcb->input_flow.buffer = buffer;
 
+    pcb->input_flow.segment = NULL;
+
     pcb->input_flow.remaining_data = length;
 
     store_sf_data(&pcb->input_flow, _frame->data, _frame->len);
@@ -179,12 +292,15 @@ static void received_sf(struct isotp_pcb *pcb, void *frame)
     {
         isotp_received(pcb, pcb->input_flow.buffer);
     }
+#endif
 }
 
 static void received_ff(struct isotp_pcb *pcb, void *frame)
 {
     uint32_t length;
 
+    uint32_t block_length;
+
     struct lwcan_buffer *buffer;
 
 #if ISOTP_CANFD
@@ -200,7 +316,26 @@ static void received_ff(struct isotp_pcb *pcb, void *frame)
 
     length = isotp_get_ff_dl(_frame->data);
 
-    buffer = lwcan_buffer_new(length);
+    pcb->input_flow.stream_remaining = 0;
+
+    pcb->input_flow.stream_offset = 0;
+
+    if (pcb->receive_block != NULL)
+    {
+        /* Only the first block is allocated, it holds the first frame data and a full block of consecutive frames */
+        pcb->input_flow.stream_block = (uint32_t)ISOTP_RECEIVE_STREAM_BS * (uint32_t)(_frame->len - CF_DATA_OFFSET);
+
+        block_length = (uint32_t)(_frame->len - get_ff_data_offset(_frame->data)) + pcb->input_flow.stream_block;
+
+        if (length > block_length)
+        {
+            pcb->input_flow.stream_remaining = length - block_length;
+
+            length = block_length;
+        }
+    }
+
+    buffer = alloc_rx_buffer(pcb, length);
 
     if (buffer == NULL)
     {
@@ -225,6 +360,8 @@ static void received_ff(struct isotp_pcb *pcb, void *frame)
 
     pcb->input_flow.buffer = buffer;
 
+    pcb->input_flow.segment = NULL;
+
     pcb->input_flow.remaining_data = length;
 
     store_ff_data(&pcb->input_flow, _frame->data, _frame->len);
@@ -234,21 +371,111 @@ static void received_ff(struct isotp_pcb *pcb, void *frame)
     pcb->input_flow.fs = FS_READY;
 
 output:
-    pcb->input_flow.bs = ISOTP_RECEIVE_BS;
+    pcb->input_flow.bs = (pcb->receive_block != NULL) ? ISOTP_RECEIVE_STREAM_BS : ISOTP_RECEIVE_BS;
+
+    pcb->input_flow.st = ISOTP_RECEIVE_ST;
+
+    pcb->input_flow.cf_num = 0;
+
+    pcb->input_flow.state = ISOTP_TX_FC;
+
+    isotp_defer_output(&pcb->input_flow);
+}
+
+/* The sender gets the flow control frame for the next block only after the previous one is given back */
+static void stream_next_block(struct isotp_pcb *pcb)
+{
+    uint32_t length;
+
+    struct lwcan_buffer *buffer;
+
+    length = pcb->input_flow.stream_block;
+
+    if (length > pcb->input_flow.stream_remaining)
+    {
+        length = pcb->input_flow.stream_remaining;
+    }
+
+    buffer = alloc_rx_buffer(pcb, length);
+
+    if (buffer == NULL)
+    {
+        LWCAN_ASSERT("buffer != NULL", buffer != NULL);
+
+        pcb->input_flow.fs = FS_OVERFLOW;
+
+        if (pcb->error != NULL)
+        {
+            pcb->error(pcb->callback_arg, ERROR_MEMORY);
+        }
+    }
+    else
+    {
+        buffer->next = pcb->input_flow.buffer;
+
+        pcb->input_flow.buffer = buffer;
+
+        pcb->input_flow.segment = NULL;
+
+        pcb->input_flow.remaining_data = length;
+
+        pcb->input_flow.stream_remaining -= length;
+
+        pcb->input_flow.fs = FS_READY;
+    }
+
+    pcb->input_flow.bs = ISOTP_RECEIVE_STREAM_BS;
 
     pcb->input_flow.st = ISOTP_RECEIVE_ST;
 
+    pcb->input_flow.cf_num = 0;
+
     pcb->input_flow.state = ISOTP_TX_FC;
 
-    lwcan_timeout(0, isotp_in_flow_output, pcb);
+    isotp_defer_output(&pcb->input_flow);
+}
+
+static void received_block(struct isotp_pcb *pcb)
+{
+    struct lwcan_buffer *buffer;
+
+    uint32_t offset;
+
+    uint32_t length;
+
+    buffer = pcb->input_flow.buffer;
+
+    offset = pcb->input_flow.stream_offset;
+
+    length = offset + buffer->length;
+
+    pcb->input_flow.stream_offset = length;
+
+    if (pcb->input_flow.stream_remaining == 0)
+    {
+        pcb->input_flow.state = ISOTP_IDLE;
+
+        pcb->receive_block(pcb->callback_arg, pcb, buffer, offset);
+
+        if (pcb->receive_done != NULL)
+        {
+            pcb->receive_done(pcb->callback_arg, pcb, length);
+        }
+
+        return;
+    }
+
+    pcb->input_flow.state = ISOTP_WAIT_RECEIVED;
+
+    lwcan_timer_rearm(&pcb->input_flow.timer, ISOTP_N_BS);
+
+    pcb->receive_block(pcb->callback_arg, pcb, buffer, offset);
 }
 
 static void received_cf(struct isotp_pcb *pcb, void *frame)
 {
     uint8_t sn;
 
-    int8_t cf_left;
-
 #if ISOTP_CANFD
     struct canfd_frame *_frame = (struct canfd_frame *)frame;
 #else
@@ -260,7 +487,7 @@ static void received_cf(struct isotp_pcb *pcb, void *frame)
         return;
     }
 
-    lwcan_untimeout(isotp_input_error_handler, pcb);
+    lwcan_timer_cancel(&pcb->input_flow.timer);
 
     sn = _frame->data[CF_SN_OFFSET] & CF_SN_MASK;
 
@@ -275,8 +502,24 @@ static void received_cf(struct isotp_pcb *pcb, void *frame)
 
     store_cf_data(&pcb->input_flow, _frame->data, _frame->len);
 
+    pcb->input_flow.cf_num += 1;
+
+    pcb->input_flow.cf_sn += 1;
+
+    if (pcb->input_flow.cf_sn > CF_SN_MASK)
+    {
+        pcb->input_flow.cf_sn = 0;
+    }
+
     if (pcb->input_flow.remaining_data == 0)
     {
+        if (pcb->receive_block != NULL)
+        {
+            received_block(pcb);
+
+            return;
+        }
+
         pcb->input_flow.state = ISOTP_IDLE;
 
         if (pcb->receive != NULL)
@@ -291,20 +534,11 @@ static void received_cf(struct isotp_pcb *pcb, void *frame)
         return;
     }
 
-    cf_left = pcb->input_flow.bs - pcb->input_flow.cf_sn;
-
-    pcb->input_flow.cf_sn += 1;
-
-    if (pcb->input_flow.cf_sn > CF_SN_MASK)
-    {
-        pcb->input_flow.cf_sn = 0;
-    }
-
-    if (pcb->input_flow.bs == 0 || cf_left > 0)
+    if (pcb->input_flow.bs == 0 || pcb->input_flow.cf_num < pcb->input_flow.bs)
     {
         pcb->input_flow.state = ISOTP_WAIT_CF;
 
-        lwcan_timeout(ISOTP_N_CR, isotp_input_error_handler, pcb);
+        lwcan_timer_rearm(&pcb->input_flow.timer, ISOTP_N_CR);
 
         return;
     }
@@ -312,9 +546,11 @@ static void received_cf(struct isotp_pcb *pcb, void *frame)
     pcb->input_flow.fs = FS_READY;
 
 output:
+    pcb->input_flow.cf_num = 0;
+
     pcb->input_flow.state = ISOTP_TX_FC;
 
-    lwcan_timeout(0, isotp_in_flow_output, pcb);
+    isotp_defer_output(&pcb->input_flow);
 }
 
 static void received_fc(struct isotp_pcb *pcb, void *frame)
@@ -330,7 +566,7 @@ static void received_fc(struct isotp_pcb *pcb, void *frame)
         return;
     }
 
-    lwcan_untimeout(isotp_output_error_handler, pcb);
+    lwcan_timer_cancel(&pcb->output_flow.timer);
 
     pcb->output_flow.fs = _frame->data[FC_FS_OFFSET] & FC_FS_MASK;
 
@@ -338,7 +574,7 @@ static void received_fc(struct isotp_pcb *pcb, void *frame)
     {
         pcb->output_flow.n_wft -= 1;
 
-        lwcan_timeout(ISOTP_N_BS, isotp_output_error_handler, pcb);
+        lwcan_timer_rearm(&pcb->output_flow.timer, ISOTP_N_BS);
 
         return;
     }
@@ -359,6 +595,8 @@ static void received_fc(struct isotp_pcb *pcb, void *frame)
 
     pcb->output_flow.bs = _frame->data[FC_BS_OFFSET];
 
+    pcb->output_flow.cf_num = 0;
+
     pcb->output_flow.st = _frame->data[FC_ST_OFFSET];
 
     if (pcb->output_flow.st > ST_MS_RANGE_MAX)
@@ -368,28 +606,18 @@ static void received_fc(struct isotp_pcb *pcb, void *frame)
 
     pcb->output_flow.state = ISOTP_TX_CF;
 
-    lwcan_timeout(0, isotp_out_flow_output, pcb);
+    isotp_defer_output(&pcb->output_flow);
 }
 
-void isotp_input(struct canif *canif, void *frame)
+static struct isotp_pcb *isotp_find_pcb(uint8_t if_index, canid_t can_id)
 {
-    uint8_t if_index;
-
     struct isotp_pcb *pcb;
 
-#if ISOTP_CANFD
-    struct canfd_frame *_frame = (struct canfd_frame *)frame;
-#else
-    struct can_frame *_frame = (struct can_frame *)frame;
-#endif
-
-    if_index = canif_get_index(canif);
-
     pcb = isotp_get_pcb_list();
 
     while (pcb != NULL)
     {
-        if (pcb->if_index == if_index && pcb->rx_id == _frame->can_id)
+        if (pcb->if_index == if_index && pcb->rx_id == can_id)
         {
             break;
         }
@@ -399,10 +627,16 @@ void isotp_input(struct canif *canif, void *frame)
         }
     }
 
-    if (pcb == NULL)
-    {
-        return;
-    }
+    return pcb;
+}
+
+static void isotp_dispatch(struct isotp_pcb *pcb, void *frame)
+{
+#if ISOTP_CANFD
+    struct canfd_frame *_frame = (struct canfd_frame *)frame;
+#else
+    struct can_frame *_frame = (struct can_frame *)frame;
+#endif
 
     switch (_frame->data[FRAME_TYPE_OFFSET] & FRAME_TYPE_MASK)
     {
@@ -427,8 +661,63 @@ void isotp_input(struct canif *canif, void *frame)
     }
 }
 
+void isotp_input(struct canif *canif, void *frame)
+{
+    struct isotp_pcb *pcb;
+
+#if ISOTP_CANFD
+    struct canfd_frame *_frame = (struct canfd_frame *)frame;
+#else
+    struct can_frame *_frame = (struct can_frame *)frame;
+#endif
+
+    pcb = isotp_find_pcb(canif_get_index(canif), _frame->can_id);
+
+    if (pcb == NULL)
+    {
+        return;
+    }
+
+    isotp_dispatch(pcb, frame);
+}
+
+void isotp_input_hinted(uint8_t if_index, void *frame, struct isotp_input_hint *hint)
+{
+    struct isotp_pcb *pcb;
+
+#if ISOTP_CANFD
+    struct canfd_frame *_frame = (struct canfd_frame *)frame;
+#else
+    struct can_frame *_frame = (struct can_frame *)frame;
+#endif
+
+    /* Consecutive frames of one transfer skip the walk of the PCB list. The callbacks of the previous
+     * frame may have removed or rebound its PCB, which changes the version */
+    if (hint->pcb != NULL && hint->version == isotp_get_pcb_list_version() && hint->pcb->rx_id == _frame->can_id)
+    {
+        pcb = hint->pcb;
+    }
+    else
+    {
+        pcb = isotp_find_pcb(if_index, _frame->can_id);
+
+        hint->pcb = pcb;
+
+        hint->version = isotp_get_pcb_list_version();
+    }
+
+    if (pcb == NULL)
+    {
+        return;
+    }
+
+    isotp_dispatch(pcb, frame);
+}
+
 lwcanerr_t isotp_received(struct isotp_pcb *pcb, struct lwcan_buffer *buffer)
 {
+    uint8_t block_held;
+
     if (pcb == NULL || buffer == NULL)
     {
         LWCAN_ASSERT("pcb != NULL", pcb != NULL);
@@ -437,8 +726,59 @@ lwcanerr_t isotp_received(struct isotp_pcb *pcb, struct lwcan_buffer *buffer)
         return ERROR_ARG;
     }
 
+    block_held = (pcb->input_flow.state == ISOTP_WAIT_RECEIVED && buffer == pcb->input_flow.buffer);
+
     isotp_remove_buffer(&pcb->input_flow, buffer);
 
+    if (block_held)
+    {
+        lwcan_timer_cancel(&pcb->input_flow.timer);
+
+        stream_next_block(pcb);
+    }
+
+    return ERROR_OK;
+}
+
+lwcanerr_t isotp_post_rx_buffer(struct isotp_pcb *pcb, uint8_t *data, uint32_t size, lwcan_buffer_release_function release, void *release_arg)
+{
+    struct lwcan_buffer *buffer;
+
+    struct lwcan_buffer *buffer_temp;
+
+    if (pcb == NULL || data == NULL || size == 0)
+    {
+        LWCAN_ASSERT("pcb != NULL", pcb != NULL);
+        LWCAN_ASSERT("data != NULL", data != NULL);
+        LWCAN_ASSERT("size != 0", size != 0);
+
+        return ERROR_ARG;
+    }
+
+    buffer = lwcan_buffer_alloc_posted(data, size, release, release_arg);
+
+    if (buffer == NULL)
+    {
+        return ERROR_MEMORY;
+    }
+
+    /* Buffers are kept in posting order, so the first one that fits is used */
+    if (pcb->rx_buffers == NULL)
+    {
+        pcb->rx_buffers = buffer;
+    }
+    else
+    {
+        buffer_temp = pcb->rx_buffers;
+
+        while (buffer_temp->next != NULL)
+        {
+            buffer_temp = buffer_temp->next;
+        }
+
+        buffer_temp->next = buffer;
+    }
+
     return ERROR_OK;
 }
 
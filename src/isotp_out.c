@@ -4,11 +4,16 @@
 
 #include "lwcan/isotp.h"
 #include "lwcan/private/isotp_private.h"
+#include "lwcan/private/buffer_private.h"
 #include "lwcan/timeouts.h"
 #include "lwcan/debug.h"
 
 #include <string.h>
 
+#if ISOTP_OUTPUT_BATCH_NUM < 1 || ISOTP_OUTPUT_BATCH_NUM > 255
+#error "ISOTP_OUTPUT_BATCH_NUM must be between 1 and 255"
+#endif
+
 static void sent_sf(struct isotp_pcb *pcb)
 {
     uint32_t length;
@@ -26,6 +31,25 @@ static void sent_sf(struct isotp_pcb *pcb)
     
 }
 
+#if ISOTP_SF_DIRECT
+static void sent_sf_direct(struct isotp_pcb *pcb)
+{
+    uint32_t length;
+
+    /* There is no buffer, the length is kept in the flow until the frame is confirmed */
+    length = pcb->output_flow.remaining_data;
+
+    pcb->output_flow.remaining_data = 0;
+
+    pcb->output_flow.state = ISOTP_IDLE;
+
+    if (pcb->sent != NULL)
+    {
+        pcb->sent(pcb->callback_arg, pcb, length);
+    }
+}
+#endif
+
 static void sent_ff(struct isotp_pcb *pcb)
 {
     if (pcb->output_flow.state != ISOTP_TX_FF)
@@ -35,14 +59,19 @@ static void sent_ff(struct isotp_pcb *pcb)
 
     pcb->output_flow.state = ISOTP_WAIT_FC;
 
-    lwcan_timeout(ISOTP_N_BS, isotp_output_error_handler, pcb);
+    lwcan_timer_rearm(&pcb->output_flow.timer, ISOTP_N_BS);
 }
 
 static void sent_cf(struct isotp_pcb *pcb)
 {
     uint32_t length;
 
-    int8_t cf_left;
+    uint8_t cf_count;
+
+    /* A batch of consecutive frames is confirmed at once */
+    cf_count = (pcb->output_flow.cf_batch != 0) ? pcb->output_flow.cf_batch : 1;
+
+    pcb->output_flow.cf_batch = 0;
 
     if (pcb->output_flow.remaining_data == 0)
     {
@@ -60,26 +89,28 @@ static void sent_cf(struct isotp_pcb *pcb)
         return;
     }
 
-    cf_left = pcb->output_flow.bs - pcb->output_flow.cf_sn;
+    pcb->output_flow.cf_num += cf_count;
 
-    pcb->output_flow.cf_sn += 1;
+    pcb->output_flow.cf_sn = (uint8_t)((pcb->output_flow.cf_sn + cf_count) & CF_SN_MASK);
 
-    if (pcb->output_flow.cf_sn > CF_SN_MASK)
-    {
-        pcb->output_flow.cf_sn = 0;
-    }
-
-    if (pcb->output_flow.bs == 0 || cf_left > 0)
+    if (pcb->output_flow.bs == 0 || pcb->output_flow.cf_num < pcb->output_flow.bs)
     {
         pcb->output_flow.state = ISOTP_TX_CF;
 
-        lwcan_timeout(pcb->output_flow.st, isotp_out_flow_output, pcb);
+        if (pcb->output_flow.st == 0)
+        {
+            isotp_defer_output(&pcb->output_flow);
+        }
+        else
+        {
+            lwcan_timer_rearm(&pcb->output_flow.output_timer, pcb->output_flow.st);
+        }
     }
     else
     {
         pcb->output_flow.state = ISOTP_WAIT_FC;
 
-        lwcan_timeout(ISOTP_N_BS, isotp_output_error_handler, pcb);
+        lwcan_timer_rearm(&pcb->output_flow.timer, ISOTP_N_BS);
     }
 }
 
@@ -99,7 +130,7 @@ static void sent_fc(struct isotp_pcb *pcb)
 
     pcb->input_flow.state = ISOTP_WAIT_CF;
 
-    lwcan_timeout(ISOTP_N_CR, isotp_input_error_handler, pcb);
+    lwcan_timer_rearm(&pcb->input_flow.timer, ISOTP_N_CR);
 }
 
 void isotp_sent(void *arg, lwcanerr_t error)
@@ -110,7 +141,10 @@ void isotp_sent(void *arg, lwcanerr_t error)
 
     if (error != ERROR_OK)
     {
-        isotp_remove_buffer(flow, flow->buffer);
+        if (flow->state != ISOTP_TX_SF_DIRECT)
+        {
+            isotp_remove_buffer(flow, flow->buffer);
+        }
 
         flow->state = ISOTP_IDLE;
 
@@ -126,6 +160,12 @@ void isotp_sent(void *arg, lwcanerr_t error)
         sent_sf(flow->pcb);
         break;
 
+#if ISOTP_SF_DIRECT
+    case ISOTP_TX_SF_DIRECT:
+        sent_sf_direct(flow->pcb);
+        break;
+#endif
+
     case ISOTP_TX_FF:
         sent_ff(flow->pcb);
         break;
@@ -140,6 +180,63 @@ void isotp_sent(void *arg, lwcanerr_t error)
     }
 }
 
+#if ISOTP_OUTPUT_BATCH_NUM > 1
+/* Consecutive frames without separation time go to the interface together, up to the end of the block */
+static lwcanerr_t output_cf_batch(struct isotp_pcb *pcb, struct canif *canif)
+{
+    struct isotp_flow *flow = &pcb->output_flow;
+
+    uint8_t count = 0, limit = ISOTP_OUTPUT_BATCH_NUM, cf_sn;
+
+    lwcanerr_t ret;
+
+#if ISOTP_CANFD
+    struct canfd_frame frames[ISOTP_OUTPUT_BATCH_NUM];
+#else
+    struct can_frame frames[ISOTP_OUTPUT_BATCH_NUM];
+#endif
+
+    if (flow->bs != 0 && (uint8_t)(flow->bs - flow->cf_num) < limit)
+    {
+        limit = (uint8_t)(flow->bs - flow->cf_num);
+    }
+
+    /* isotp_fill_cf() takes the serial number from the flow, sent_cf() moves it on for the whole batch */
+    cf_sn = flow->cf_sn;
+
+    while (count < limit && flow->remaining_data != 0)
+    {
+        frames[count].can_id = pcb->tx_id;
+
+#if ISOTP_CANFD
+        if (ISOTP_CANFD_BRS)
+        {
+            frames[count].flags = CANFD_BRS;
+        }
+#endif
+
+        isotp_fill_cf(flow, &frames[count]);
+
+        flow->cf_sn = (uint8_t)((flow->cf_sn + 1) & CF_SN_MASK);
+
+        count++;
+    }
+
+    flow->cf_sn = cf_sn;
+
+    flow->cf_batch = count;
+
+    ret = canif->output_batch(canif, frames, sizeof(frames[0]), count, ISOTP_N_CS, isotp_sent, flow);
+
+    if (ret != ERROR_OK)
+    {
+        flow->cf_batch = 0;
+    }
+
+    return ret;
+}
+#endif
+
 void isotp_out_flow_output(void *arg)
 {
     struct isotp_pcb *pcb;
@@ -196,6 +293,14 @@ void isotp_out_flow_output(void *arg)
             break;
 
         case ISOTP_TX_CF:
+#if ISOTP_OUTPUT_BATCH_NUM > 1
+            if (pcb->output_flow.st == 0 && canif->output_batch != NULL)
+            {
+                ret = output_cf_batch(pcb, canif);
+
+                goto sent;
+            }
+#endif
             isotp_fill_cf(&pcb->output_flow, &frame);
             timeout = ISOTP_N_CS;
             break;
@@ -206,6 +311,10 @@ void isotp_out_flow_output(void *arg)
 
     ret = canif->output(canif, &frame, sizeof(frame), timeout, isotp_sent, &pcb->output_flow);
 
+#if ISOTP_OUTPUT_BATCH_NUM > 1
+sent:
+#endif
+
     if (ret == ERROR_OK)
     {
         return;
@@ -221,6 +330,89 @@ void isotp_out_flow_output(void *arg)
     }
 }
 
+static void send_buffer(struct isotp_pcb *pcb, struct lwcan_buffer *buffer)
+{
+    buffer->next = pcb->output_flow.buffer;
+
+    pcb->output_flow.buffer = buffer;
+
+    pcb->output_flow.segment = NULL;
+
+    pcb->output_flow.remaining_data = buffer->length;
+
+#if ISOTP_CANFD
+    if (pcb->output_flow.remaining_data > (CANFD_MAX_DLEN - FD_SF_DATA_OFFSET))
+#else
+    if (pcb->output_flow.remaining_data > (CAN_MAX_DLEN - SF_DATA_OFFSET))
+#endif
+    {
+        pcb->output_flow.state = ISOTP_TX_FF;
+
+        pcb->output_flow.cf_sn = 1;
+
+        pcb->output_flow.cf_batch = 0;
+
+        pcb->output_flow.n_wft = ISOTP_N_WFT;
+    }
+    else
+    {
+        pcb->output_flow.state = ISOTP_TX_SF;
+    }
+
+    isotp_defer_output(&pcb->output_flow);
+}
+
+#if ISOTP_SF_DIRECT
+/* A single frame is encoded from the caller's data and handed to the interface right away */
+static lwcanerr_t send_sf_direct(struct isotp_pcb *pcb, const uint8_t *data, uint8_t length)
+{
+    struct canif *canif;
+
+    lwcanerr_t ret;
+
+#if ISOTP_CANFD
+    struct canfd_frame frame;
+#else
+    struct can_frame frame;
+#endif
+
+    canif = canif_get_by_index(pcb->if_index);
+
+    if (canif == NULL)
+    {
+        LWCAN_ASSERT("canif != NULL", canif != NULL);
+
+        return ERROR_IF;
+    }
+
+    frame.can_id = pcb->tx_id;
+
+#if ISOTP_CANFD
+    if (ISOTP_CANFD_BRS)
+    {
+        frame.flags = CANFD_BRS;
+    }
+#endif
+
+    isotp_encode_sf(&frame, data, length);
+
+    pcb->output_flow.remaining_data = length;
+
+    pcb->output_flow.state = ISOTP_TX_SF_DIRECT;
+
+    ret = canif->output(canif, &frame, sizeof(frame), ISOTP_N_AS, isotp_sent, &pcb->output_flow);
+
+    if (ret != ERROR_OK)
+    {
+        pcb->output_flow.remaining_data = 0;
+
+        pcb->output_flow.state = ISOTP_IDLE;
+    }
+
+    return ret;
+}
+#endif
+
 lwcanerr_t isotp_send(struct isotp_pcb *pcb, const uint8_t *data, uint32_t length)
 {
     struct lwcan_buffer *buffer;
@@ -239,7 +431,18 @@ lwcanerr_t isotp_send(struct isotp_pcb *pcb, const uint8_t *data, uint32_t lengt
         return ERROR_INPROGRESS;
     }
 
-    buffer = lwcan_buffer_new(length);
+#if ISOTP_SF_DIRECT
+#if ISOTP_CANFD
+    if (length <= (CANFD_MAX_DLEN - FD_SF_DATA_OFFSET))
+#else
+    if (length <= (CAN_MAX_DLEN - SF_DATA_OFFSET))
+#endif
+    {
+        return send_sf_direct(pcb, data, (uint8_t)length);
+    }
+#endif
+
+    buffer = isotp_buffer_alloc(pcb, length, LWCAN_MEM_OWNER_ISOTP_TX);
 
     if (buffer == NULL)
     {
@@ -250,30 +453,39 @@ lwcanerr_t isotp_send(struct isotp_pcb *pcb, const uint8_t *data, uint32_t lengt
 
     lwcan_buffer_copy_to(buffer, data, length);
 
-    buffer->next = pcb->output_flow.buffer;
+    send_buffer(pcb, buffer);
 
-    pcb->output_flow.buffer = buffer;
+    return ERROR_OK;
+}
 
-    pcb->output_flow.remaining_data = length;
+lwcanerr_t isotp_send_ref(struct isotp_pcb *pcb, const uint8_t *data, uint32_t length, lwcan_buffer_release_function release, void *release_arg)
+{
+    struct lwcan_buffer *buffer;
 
-#if ISOTP_CANFD
-    if (pcb->output_flow.remaining_data > (CANFD_MAX_DLEN - FD_SF_DATA_OFFSET))
-#else
-    if (pcb->output_flow.remaining_data > (CAN_MAX_DLEN - SF_DATA_OFFSET))
-#endif
+    if (pcb == NULL || data == NULL || length == 0)
     {
-        pcb->output_flow.state = ISOTP_TX_FF;
+        LWCAN_ASSERT("pcb != NULL", pcb != NULL);
+        LWCAN_ASSERT("data != NULL", data != NULL);
+        LWCAN_ASSERT("length != 0", length != 0);
 
-        pcb->output_flow.cf_sn = 1;
+        return ERROR_ARG;
+    }
 
-        pcb->output_flow.n_wft = ISOTP_N_WFT;
+    if (pcb->output_flow.state != ISOTP_IDLE)
+    {
+        return ERROR_INPROGRESS;
     }
-    else
+
+    buffer = lwcan_buffer_alloc_ref(data, length, release, release_arg, LWCAN_MEM_OWNER_ISOTP_TX);
+
+    if (buffer == NULL)
     {
-        pcb->output_flow.state = ISOTP_TX_SF;
+        LWCAN_ASSERT("buffer != NULL", buffer != NULL);
+
+        return ERROR_MEMORY;
     }
 
-    lwcan_timeout(0, isotp_out_flow_output, pcb);
+    send_buffer(pcb, buffer);
 
     return ERROR_OK;
 }
@@ -1,190 +1,370 @@
 #include "lwcan/memory.h"
+#include "lwcan/private/memory_private.h"
 #include "lwcan/error.h"
 #include "lwcan/options.h"
 #include "lwcan/debug.h"
 
+#include <stdint.h>
+#include <string.h>
+
 #define MEMORY_BYTE_ALIGNMENT 8
 
-#define MEMORY_BYTE_ALIGNMENT_MASK (0x0007)
+/* Regions too small to hold a couple of block headers are refused */
+#define MEM_REGION_MIN_SIZE 64
 
-/* Block sizes must not get too small. */
-#define MEMORY_HEAP_MINIMUM_BLOCK_SIZE ((size_t)(xHeapStructSize << 1))
+#if LWCAN_MEM_OWNER_STATS
+/* Placed in front of every allocation to remember who made it and how big it was */
+struct mem_owner_tag
+{
+    uint32_t size;
 
-/* Assumes 8bit bytes! */
-#define MEMORY_HEAP_BITS_PER_BYTE ((size_t)8)
+    uint8_t owner;
+};
 
-static uint8_t memory_heap[LWCAN_MEM_SIZE];
+/* The tag is padded so the memory handed out stays aligned */
+#define MEM_OWNER_TAG_SIZE ((sizeof(struct mem_owner_tag) + (MEMORY_BYTE_ALIGNMENT - 1)) & ~((size_t)MEMORY_BYTE_ALIGNMENT - 1))
 
-/* Define the linked list structure.  This is used to link free blocks in order
- * of their memory address. */
-typedef struct A_BLOCK_LINK
+static struct lwcan_mem_owner_stats mem_owner_stats[LWCAN_MEM_OWNER_MAX];
+#endif
+
+struct mem_region
 {
-    struct A_BLOCK_LINK *pxNextFreeBlock; /*<< The next free block in the list. */
+    uint8_t *start;
 
-    size_t xBlockSize;                    /*<< The size of the free block. */
-} BlockLink_t;
+    uint8_t *end;
 
-/*
- * Inserts a block of memory that is being freed into the correct position in
- * the list of free memory blocks.  The block being freed will be merged with
- * the block in front it and/or the block behind it if the memory blocks are
- * adjacent to each other.
- */
-static void prvInsertBlockIntoFreeList(BlockLink_t *pxBlockToInsert);
+    uint8_t heap;
+};
 
-/*
- * Called automatically to setup the required heap structures the first time
- * lwcan_malloc() is called.
- */
-static void prvHeapInit(void);
+#if LWCAN_MEM_SIZE > 0
+static uint8_t memory_heap[LWCAN_MEM_SIZE];
+#endif
 
-/*-----------------------------------------------------------*/
+static struct mem_region mem_regions[LWCAN_MEM_REGIONS_NUM];
 
-/* The size of the structure placed at the beginning of each allocated memory
- * block must by correctly byte aligned. */
-static const size_t xHeapStructSize = (sizeof(BlockLink_t) + ((size_t)(MEMORY_BYTE_ALIGNMENT - 1))) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+static uint8_t mem_regions_num = 0;
 
-/* Create a couple of list links to mark the start and end of the list. */
-static BlockLink_t xStart, *pxEnd = NULL;
+/* Number of regions added for each class, classes without one use LWCAN_MEM_CLASS_DEFAULT */
+static uint8_t mem_class_regions[LWCAN_MEM_CLASS_MAX];
 
-/* Keeps track of the number of calls to allocate and free memory as well as the
- * number of free bytes remaining, but says nothing about fragmentation. */
-static size_t xFreeBytesRemaining = 0U;
-static size_t xMinimumEverFreeBytesRemaining = 0U;
-static size_t xNumberOfSuccessfulAllocations = 0;
-static size_t xNumberOfSuccessfulFrees = 0;
+static size_t mem_failed_allocations[LWCAN_MEM_CLASS_MAX];
 
-/* Gets set to the top bit of an size_t type.  When this bit in the xBlockSize
- * member of an BlockLink_t structure is set then the block belongs to the
- * application.  When the bit is free the block is still part of the free heap
- * space. */
-static size_t xBlockAllocatedBit = 0;
+static uint8_t mem_initialised = 0;
 
-/*-----------------------------------------------------------*/
+/* Allocations not freed yet, the backend can only be changed while there are none */
+static size_t mem_outstanding = 0;
 
-void *lwcan_malloc(size_t size)
+static lwcanerr_t mem_add_region(void *start, size_t size, lwcan_mem_class_t mem_class)
 {
-    BlockLink_t *pxBlock, *pxPreviousBlock, *pxNewBlockLink;
-    void *pvReturn = NULL;
+    uint8_t *region_start = (uint8_t *)start;
+
+    if (mem_regions_num >= LWCAN_MEM_REGIONS_NUM)
+    {
+        LWCAN_ASSERT("mem_regions_num < LWCAN_MEM_REGIONS_NUM", mem_regions_num < LWCAN_MEM_REGIONS_NUM);
+
+        return ERROR_MEMORY;
+    }
 
+    for (uint8_t i = 0; i < mem_regions_num; i++)
     {
-        /* If this is the first call to malloc then the heap will require
-         * initialisation to setup the list of free blocks. */
-        if (pxEnd == NULL)
+        if (region_start < mem_regions[i].end && (region_start + size) > mem_regions[i].start)
         {
-            prvHeapInit();
+            LWCAN_ASSERT("regions do not overlap", 0);
+
+            return ERROR_ARG;
         }
+    }
+
+    mem_regions[mem_regions_num].start = region_start;
+
+    mem_regions[mem_regions_num].end = region_start + size;
+
+    mem_regions[mem_regions_num].heap = (uint8_t)mem_class;
+
+    mem_regions_num += 1;
+
+    mem_class_regions[mem_class] += 1;
+
+    lwcan_heap_add_region((uint8_t)mem_class, start, size);
+
+    return ERROR_OK;
+}
+
+/* The built-in heap is added lazily, so the allocator works without lwcan_init() */
+static void mem_init(void)
+{
+    if (mem_initialised)
+    {
+        return;
+    }
+
+    mem_initialised = 1;
+
+#if LWCAN_MEM_SIZE > 0
+    mem_add_region(memory_heap, sizeof(memory_heap), LWCAN_MEM_CLASS_DEFAULT);
+#endif
+}
+
+static uint8_t mem_get_heap(lwcan_mem_class_t mem_class)
+{
+    if (mem_class_regions[mem_class] == 0)
+    {
+        return LWCAN_MEM_CLASS_DEFAULT;
+    }
+
+    return (uint8_t)mem_class;
+}
 
-        /* Check the requested block size is not so large that the top bit is
-         * set.  The top bit of the block size member of the BlockLink_t structure
-         * is used to determine who owns the block - the application or the
-         * kernel, so it must be free. */
-        if ((size & xBlockAllocatedBit) == 0)
+/* Find the heap an allocation was made from by the region it lies in */
+static uint8_t mem_find_heap(void *p, uint8_t *heap)
+{
+    for (uint8_t i = 0; i < mem_regions_num; i++)
+    {
+        if ((uint8_t *)p >= mem_regions[i].start && (uint8_t *)p < mem_regions[i].end)
         {
-            /* The wanted size must be increased so it can contain a BlockLink_t
-             * structure in addition to the requested amount of bytes. */
-            if ((size > 0) &&
-                ((size + xHeapStructSize) > size)) /* Overflow check */
-            {
-                size += xHeapStructSize;
-
-                /* Ensure that blocks are always aligned. */
-                if ((size & MEMORY_BYTE_ALIGNMENT_MASK) != 0x00)
-                {
-                    /* Byte alignment required. Check for overflow. */
-                    if ((size + (MEMORY_BYTE_ALIGNMENT - (size & MEMORY_BYTE_ALIGNMENT_MASK))) > size)
-                    {
-                        size += (MEMORY_BYTE_ALIGNMENT - (size & MEMORY_BYTE_ALIGNMENT_MASK));
-                        LWCAN_ASSERT("(size & MEMORY_BYTE_ALIGNMENT_MASK) == 0", (size & MEMORY_BYTE_ALIGNMENT_MASK) == 0);
-                    }
-                    else
-                    {
-                        size = 0;
-                    }
-                }
-            }
-            else
-            {
-                size = 0;
-            }
-
-            if ((size > 0) && (size <= xFreeBytesRemaining))
-            {
-                /* Traverse the list from the start  (lowest address) block until
-                 * one of adequate size is found. */
-                pxPreviousBlock = &xStart;
-                pxBlock = xStart.pxNextFreeBlock;
-
-                while ((pxBlock->xBlockSize < size) && (pxBlock->pxNextFreeBlock != NULL))
-                {
-                    pxPreviousBlock = pxBlock;
-                    pxBlock = pxBlock->pxNextFreeBlock;
-                }
-
-                /* If the end marker was reached then a block of adequate size
-                 * was not found. */
-                if (pxBlock != pxEnd)
-                {
-                    /* Return the memory space pointed to - jumping over the
-                     * BlockLink_t structure at its start. */
-                    pvReturn = (void *)(((uint8_t *)pxPreviousBlock->pxNextFreeBlock) + xHeapStructSize);
-
-                    /* This block is being returned for use so must be taken out
-                     * of the list of free blocks. */
-                    pxPreviousBlock->pxNextFreeBlock = pxBlock->pxNextFreeBlock;
-
-                    /* If the block is larger than required it can be split into
-                     * two. */
-                    if ((pxBlock->xBlockSize - size) > MEMORY_HEAP_MINIMUM_BLOCK_SIZE)
-                    {
-                        /* This block is to be split into two.  Create a new
-                         * block following the number of bytes requested. The void
-                         * cast is used to prevent byte alignment warnings from the
-                         * compiler. */
-                        pxNewBlockLink = (void *)(((uint8_t *)pxBlock) + size);
-                        LWCAN_ASSERT("(((size_t)pxNewBlockLink) & MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)pxNewBlockLink) & MEMORY_BYTE_ALIGNMENT_MASK) == 0);
-
-                        /* Calculate the sizes of two blocks split from the
-                         * single block. */
-                        pxNewBlockLink->xBlockSize = pxBlock->xBlockSize - size;
-                        pxBlock->xBlockSize = size;
-
-                        /* Insert the new block into the list of free blocks. */
-                        prvInsertBlockIntoFreeList(pxNewBlockLink);
-                    }
-
-                    xFreeBytesRemaining -= pxBlock->xBlockSize;
-
-                    if (xFreeBytesRemaining < xMinimumEverFreeBytesRemaining)
-                    {
-                        xMinimumEverFreeBytesRemaining = xFreeBytesRemaining;
-                    }
-
-                    /* The block is being returned - it is allocated and owned
-                     * by the application and has no "next" block. */
-                    pxBlock->xBlockSize |= xBlockAllocatedBit;
-                    pxBlock->pxNextFreeBlock = NULL;
-                    xNumberOfSuccessfulAllocations++;
-                }
-            }
+            *heap = mem_regions[i].heap;
+
+            return 1;
         }
+    }
+
+    return 0;
+}
+
+static void *heap_malloc(void *context, size_t size, lwcan_mem_class_t mem_class)
+{
+    (void)context;
+
+    mem_init();
+
+    return lwcan_heap_malloc(mem_get_heap(mem_class), size);
+}
+
+static void heap_free(void *context, void *p)
+{
+    uint8_t heap;
+
+    (void)context;
+
+    if (!mem_find_heap(p, &heap))
+    {
+        LWCAN_ASSERT("p belongs to a heap region", 0);
+
+        return;
+    }
+
+    lwcan_heap_free(heap, p);
+}
+
+/* Grows or shrinks the block where it is if the memory behind it allows,
+ * otherwise moves it to a new block of the same heap */
+static void *heap_realloc(void *context, void *p, size_t size)
+{
+    uint8_t heap;
+
+    void *mem;
+
+    size_t usable_size;
+
+    (void)context;
+
+    if (!mem_find_heap(p, &heap))
+    {
+        LWCAN_ASSERT("p belongs to a heap region", 0);
+
+        return NULL;
+    }
+
+    if (lwcan_heap_resize(heap, p, size))
+    {
+        return p;
+    }
+
+    mem = lwcan_heap_malloc(heap, size);
+
+    if (mem == NULL)
+    {
+        return NULL;
+    }
+
+    usable_size = lwcan_heap_usable_size(heap, p);
+
+    memcpy(mem, p, (usable_size < size) ? usable_size : size);
+
+    lwcan_heap_free(heap, p);
+
+    return mem;
+}
+
+static size_t heap_usable_size(void *context, void *p)
+{
+    uint8_t heap;
+
+    (void)context;
+
+    if (!mem_find_heap(p, &heap))
+    {
+        LWCAN_ASSERT("p belongs to a heap region", 0);
+
+        return 0;
+    }
+
+    return lwcan_heap_usable_size(heap, p);
+}
+
+static void heap_get_stats(void *context, lwcan_mem_class_t mem_class, struct lwcan_mem_stats *stats)
+{
+    (void)context;
+
+    mem_init();
+
+    lwcan_heap_get_stats((uint8_t)mem_class, stats);
+}
+
+/* The heap selected in lwcan_options.h, made of the regions added with lwcan_mem_add_region() */
+static const struct lwcan_mem_backend mem_heap_backend = {
+    heap_malloc,
+    heap_free,
+    heap_realloc,
+    heap_usable_size,
+    heap_get_stats,
+    NULL,
+};
+
+static const struct lwcan_mem_backend *mem_backend = &mem_heap_backend;
+
+lwcanerr_t lwcan_mem_set_backend(const struct lwcan_mem_backend *backend)
+{
+    if (backend != NULL && (backend->malloc == NULL || backend->free == NULL))
+    {
+        LWCAN_ASSERT("backend->malloc != NULL", backend->malloc != NULL);
+        LWCAN_ASSERT("backend->free != NULL", backend->free != NULL);
+
+        return ERROR_ARG;
+    }
+
+    if (mem_outstanding != 0)
+    {
+        LWCAN_ASSERT("no allocations are outstanding", mem_outstanding == 0);
+
+        return ERROR_INPROGRESS;
+    }
+
+    mem_backend = (backend != NULL) ? backend : &mem_heap_backend;
+
+    return ERROR_OK;
+}
+
+lwcanerr_t lwcan_mem_add_region(void *start, size_t size, lwcan_mem_class_t mem_class)
+{
+    if (start == NULL || size < MEM_REGION_MIN_SIZE || mem_class >= LWCAN_MEM_CLASS_MAX)
+    {
+        LWCAN_ASSERT("start != NULL", start != NULL);
+        LWCAN_ASSERT("size >= MEM_REGION_MIN_SIZE", size >= MEM_REGION_MIN_SIZE);
+        LWCAN_ASSERT("mem_class < LWCAN_MEM_CLASS_MAX", mem_class < LWCAN_MEM_CLASS_MAX);
+
+        return ERROR_ARG;
+    }
+
+    mem_init();
+
+    return mem_add_region(start, size, mem_class);
+}
+
+void *lwcan_malloc(size_t size)
+{
+    return lwcan_malloc_owner(size, LWCAN_MEM_OWNER_APP, LWCAN_MEM_CLASS_DEFAULT);
+}
+
+void *lwcan_malloc_class(size_t size, lwcan_mem_class_t mem_class)
+{
+    return lwcan_malloc_owner(size, LWCAN_MEM_OWNER_APP, mem_class);
+}
+
+void *lwcan_malloc_owner(size_t size, lwcan_mem_owner_t owner, lwcan_mem_class_t mem_class)
+{
+    void *mem;
+
+#if LWCAN_MEM_OWNER_STATS
+    struct mem_owner_tag *tag;
+#endif
+
+    if (owner >= LWCAN_MEM_OWNER_MAX || mem_class >= LWCAN_MEM_CLASS_MAX)
+    {
+        LWCAN_ASSERT("owner < LWCAN_MEM_OWNER_MAX", owner < LWCAN_MEM_OWNER_MAX);
+        LWCAN_ASSERT("mem_class < LWCAN_MEM_CLASS_MAX", mem_class < LWCAN_MEM_CLASS_MAX);
+
+        return NULL;
+    }
+
+#if LWCAN_MEM_OWNER_STATS
+    if (size == 0 || (uint64_t)size > UINT32_MAX || (size + MEM_OWNER_TAG_SIZE) < size)
+    {
+        mem = NULL;
+    }
+    else
+    {
+        mem = mem_backend->malloc(mem_backend->context, size + MEM_OWNER_TAG_SIZE, mem_class);
+    }
+
+    if (mem == NULL)
+    {
+        mem_failed_allocations[mem_class]++;
 
+        mem_owner_stats[owner].failed_allocations++;
+
+        return NULL;
     }
 
-    LWCAN_ASSERT("(((size_t)pvReturn) & (size_t)MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)pvReturn) & (size_t)MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+    mem_outstanding++;
+
+    tag = (struct mem_owner_tag *)mem;
+
+    tag->size = (uint32_t)size;
+
+    tag->owner = (uint8_t)owner;
+
+    mem_owner_stats[owner].used += size;
+
+    mem_owner_stats[owner].allocations++;
+
+    if (mem_owner_stats[owner].used > mem_owner_stats[owner].max)
+    {
+        mem_owner_stats[owner].max = mem_owner_stats[owner].used;
+    }
+
+    return (void *)((uint8_t *)mem + MEM_OWNER_TAG_SIZE);
+#else
+    mem = mem_backend->malloc(mem_backend->context, size, mem_class);
+
+    if (mem == NULL)
+    {
+        mem_failed_allocations[mem_class]++;
+    }
+    else
+    {
+        mem_outstanding++;
+    }
 
-    return pvReturn;
+    return mem;
+#endif
 }
-/*-----------------------------------------------------------*/
 
 void *lwcan_calloc(size_t number, size_t size)
 {
     void *mem;
 
-    uint32_t num;
-    
+    size_t num;
+
+    if (size != 0 && number > ((size_t)-1 / size))
+    {
+        mem_failed_allocations[LWCAN_MEM_CLASS_DEFAULT]++;
+
+        return NULL;
+    }
+
     num = number * size;
-    
+
     mem = lwcan_malloc(num);
 
     if (mem != NULL)
@@ -194,150 +374,298 @@ void *lwcan_calloc(size_t number, size_t size)
 
     return mem;
 }
-/*-----------------------------------------------------------*/
 
 void lwcan_free(void *p)
 {
-    uint8_t *puc = (uint8_t *)p;
+#if LWCAN_MEM_OWNER_STATS
+    struct mem_owner_tag *tag;
+#endif
 
-    BlockLink_t *pxLink;
-
-    if (p != NULL)
+    if (p == NULL)
     {
-        /* The memory being freed will have an BlockLink_t structure immediately
-         * before it. */
-        puc -= xHeapStructSize;
+        return;
+    }
 
-        /* This casting is to keep the compiler from issuing warnings. */
-        pxLink = (void *)puc;
+    mem_outstanding--;
 
-        /* Check the block is actually allocated. */
-        
-        LWCAN_ASSERT("(pxLink->xBlockSize & xBlockAllocatedBit) != 0", (pxLink->xBlockSize & xBlockAllocatedBit) != 0);
+#if LWCAN_MEM_OWNER_STATS
+    tag = (struct mem_owner_tag *)((uint8_t *)p - MEM_OWNER_TAG_SIZE);
 
-        LWCAN_ASSERT("pxLink->pxNextFreeBlock == NULL", pxLink->pxNextFreeBlock == NULL);
+    LWCAN_ASSERT("tag->owner < LWCAN_MEM_OWNER_MAX", tag->owner < LWCAN_MEM_OWNER_MAX);
 
-        if ((pxLink->xBlockSize & xBlockAllocatedBit) != 0)
-        {
-            if (pxLink->pxNextFreeBlock == NULL)
-            {
-                /* The block is being returned to the heap - it is no longer
-                 * allocated. */
-                pxLink->xBlockSize &= ~xBlockAllocatedBit;
+    if (tag->owner < LWCAN_MEM_OWNER_MAX)
+    {
+        mem_owner_stats[tag->owner].used -= tag->size;
+    }
+
+    mem_backend->free(mem_backend->context, tag);
+#else
+    mem_backend->free(mem_backend->context, p);
+#endif
+}
 
-                {
-                    /* Add this block to the list of free blocks. */
-                    xFreeBytesRemaining += pxLink->xBlockSize;
+/* Used when the backend has no realloc, copy_size is how much of p is worth keeping */
+static void *mem_realloc_copy(void *p, size_t size, size_t copy_size, lwcan_mem_class_t mem_class)
+{
+    void *mem;
 
-                    prvInsertBlockIntoFreeList(((BlockLink_t *)pxLink));
+    mem = mem_backend->malloc(mem_backend->context, size, mem_class);
 
-                    xNumberOfSuccessfulFrees++;
-                }
-            }
-        }
+    if (mem == NULL)
+    {
+        return NULL;
     }
+
+    memcpy(mem, p, (copy_size < size) ? copy_size : size);
+
+    mem_backend->free(mem_backend->context, p);
+
+    return mem;
 }
-/*-----------------------------------------------------------*/
 
-static void prvHeapInit(void) /*  */
+/*
+ * Changes the size of an allocation, keeping its contents up to the smaller of both sizes.
+ * The built-in heap grows the block into free memory directly behind it when possible,
+ * so nothing is copied. On failure NULL is returned and p is left untouched.
+ */
+void *lwcan_realloc(void *p, size_t size)
 {
-    BlockLink_t *pxFirstFreeBlock;
-    uint8_t *pucAlignedHeap;
-    size_t uxAddress;
-    size_t xTotalHeapSize = LWCAN_MEM_SIZE;
+    return lwcan_realloc_class(p, size, LWCAN_MEM_CLASS_DEFAULT);
+}
+
+void *lwcan_realloc_class(void *p, size_t size, lwcan_mem_class_t mem_class)
+{
+    void *mem;
+
+#if LWCAN_MEM_OWNER_STATS
+    struct mem_owner_tag *tag;
+
+    size_t old_size;
+#endif
+
+    if (mem_class >= LWCAN_MEM_CLASS_MAX)
+    {
+        LWCAN_ASSERT("mem_class < LWCAN_MEM_CLASS_MAX", mem_class < LWCAN_MEM_CLASS_MAX);
 
-    /* Ensure the heap starts on a correctly aligned boundary. */
-    uxAddress = (size_t)memory_heap;
+        return NULL;
+    }
+
+    if (p == NULL)
+    {
+        return lwcan_malloc_class(size, mem_class);
+    }
+
+    if (size == 0)
+    {
+        lwcan_free(p);
+
+        return NULL;
+    }
+
+#if LWCAN_MEM_OWNER_STATS
+    tag = (struct mem_owner_tag *)((uint8_t *)p - MEM_OWNER_TAG_SIZE);
+
+    LWCAN_ASSERT("tag->owner < LWCAN_MEM_OWNER_MAX", tag->owner < LWCAN_MEM_OWNER_MAX);
+
+    old_size = tag->size;
+
+    if ((uint64_t)size > UINT32_MAX || (size + MEM_OWNER_TAG_SIZE) < size)
+    {
+        mem = NULL;
+    }
+    else if (mem_backend->realloc != NULL)
+    {
+        mem = mem_backend->realloc(mem_backend->context, tag, size + MEM_OWNER_TAG_SIZE);
+    }
+    else
+    {
+        mem = mem_realloc_copy(tag, size + MEM_OWNER_TAG_SIZE, old_size + MEM_OWNER_TAG_SIZE, mem_class);
+    }
 
-    if ((uxAddress & MEMORY_BYTE_ALIGNMENT_MASK) != 0)
+    if (mem == NULL)
     {
-        uxAddress += (MEMORY_BYTE_ALIGNMENT - 1);
-        uxAddress &= ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
-        xTotalHeapSize -= uxAddress - (size_t)memory_heap;
+        mem_failed_allocations[mem_class]++;
+
+        if (tag->owner < LWCAN_MEM_OWNER_MAX)
+        {
+            mem_owner_stats[tag->owner].failed_allocations++;
+        }
+
+        return NULL;
     }
 
-    pucAlignedHeap = (uint8_t *)uxAddress;
+    /* The tag moved along with the contents */
+    tag = (struct mem_owner_tag *)mem;
 
-    /* xStart is used to hold a pointer to the first item in the list of free
-     * blocks.  The void cast is used to prevent compiler warnings. */
-    xStart.pxNextFreeBlock = (void *)pucAlignedHeap;
-    xStart.xBlockSize = (size_t)0;
+    tag->size = (uint32_t)size;
 
-    /* pxEnd is used to mark the end of the list of free blocks and is inserted
-     * at the end of the heap space. */
-    uxAddress = ((size_t)pucAlignedHeap) + xTotalHeapSize;
-    uxAddress -= xHeapStructSize;
-    uxAddress &= ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
-    pxEnd = (void *)uxAddress;
-    pxEnd->xBlockSize = 0;
-    pxEnd->pxNextFreeBlock = NULL;
+    if (tag->owner < LWCAN_MEM_OWNER_MAX)
+    {
+        mem_owner_stats[tag->owner].used = mem_owner_stats[tag->owner].used - old_size + size;
 
-    /* To start with there is a single free block that is sized to take up the
-     * entire heap space, minus the space taken by pxEnd. */
-    pxFirstFreeBlock = (void *)pucAlignedHeap;
-    pxFirstFreeBlock->xBlockSize = uxAddress - (size_t)pxFirstFreeBlock;
-    pxFirstFreeBlock->pxNextFreeBlock = pxEnd;
+        if (mem_owner_stats[tag->owner].used > mem_owner_stats[tag->owner].max)
+        {
+            mem_owner_stats[tag->owner].max = mem_owner_stats[tag->owner].used;
+        }
+    }
+
+    return (void *)((uint8_t *)mem + MEM_OWNER_TAG_SIZE);
+#else
+    if (mem_backend->realloc != NULL)
+    {
+        mem = mem_backend->realloc(mem_backend->context, p, size);
+    }
+    else if (mem_backend->usable_size != NULL)
+    {
+        mem = mem_realloc_copy(p, size, mem_backend->usable_size(mem_backend->context, p), mem_class);
+    }
+    else
+    {
+        /* Without the size of p there is no telling how much to copy */
+        mem = NULL;
+    }
 
-    /* Only one block exists - and it covers the entire usable heap space. */
-    xMinimumEverFreeBytesRemaining = pxFirstFreeBlock->xBlockSize;
-    xFreeBytesRemaining = pxFirstFreeBlock->xBlockSize;
+    if (mem == NULL)
+    {
+        mem_failed_allocations[mem_class]++;
+    }
 
-    /* Work out the position of the top bit in a size_t variable. */
-    xBlockAllocatedBit = ((size_t)1) << ((sizeof(size_t) * MEMORY_HEAP_BITS_PER_BYTE) - 1);
+    return mem;
+#endif
 }
-/*-----------------------------------------------------------*/
 
-static void prvInsertBlockIntoFreeList(BlockLink_t *pxBlockToInsert) /*  */
+/* Bytes that can be used at p, which may be more than were asked for. 0 if the backend can not tell */
+size_t lwcan_mem_usable_size(void *p)
 {
-    BlockLink_t *pxIterator;
-    uint8_t *puc;
+    if (p == NULL || mem_backend->usable_size == NULL)
+    {
+        return 0;
+    }
+
+#if LWCAN_MEM_OWNER_STATS
+    return mem_backend->usable_size(mem_backend->context, (uint8_t *)p - MEM_OWNER_TAG_SIZE) - MEM_OWNER_TAG_SIZE;
+#else
+    return mem_backend->usable_size(mem_backend->context, p);
+#endif
+}
 
-    /* Iterate through the list until a block is found that has a higher address
-     * than the block being inserted. */
-    for (pxIterator = &xStart; pxIterator->pxNextFreeBlock < pxBlockToInsert; pxIterator = pxIterator->pxNextFreeBlock)
+static void mem_calculate_fragmentation(struct lwcan_mem_stats *stats)
+{
+    /* Share of the free space which is not usable by one allocation of the largest possible size */
+    if (stats->free_size != 0)
     {
-        /* Nothing to do here, just iterate to the right position. */
+        stats->fragmentation = (uint8_t)(100 - ((stats->largest_free_block * 100) / stats->free_size));
     }
+}
 
-    /* Do the block being inserted, and the block it is being inserted after
-     * make a contiguous block of memory? */
-    puc = (uint8_t *)pxIterator;
+lwcanerr_t lwcan_mem_get_stats(struct lwcan_mem_stats *stats)
+{
+    struct lwcan_mem_stats heap_stats;
 
-    if ((puc + pxIterator->xBlockSize) == (uint8_t *)pxBlockToInsert)
+    if (stats == NULL)
     {
-        pxIterator->xBlockSize += pxBlockToInsert->xBlockSize;
-        pxBlockToInsert = pxIterator;
+        LWCAN_ASSERT("stats != NULL", stats != NULL);
+
+        return ERROR_ARG;
     }
 
-    /* Do the block being inserted, and the block it is being inserted before
-     * make a contiguous block of memory? */
-    puc = (uint8_t *)pxBlockToInsert;
+    memset(stats, 0, sizeof(struct lwcan_mem_stats));
 
-    if ((puc + pxBlockToInsert->xBlockSize) == (uint8_t *)pxIterator->pxNextFreeBlock)
+    for (uint8_t i = 0; i < LWCAN_MEM_CLASS_MAX; i++)
     {
-        if (pxIterator->pxNextFreeBlock != pxEnd)
+        memset(&heap_stats, 0, sizeof(struct lwcan_mem_stats));
+
+        if (mem_backend->get_stats != NULL)
         {
-            /* Form one big block from the two blocks. */
-            pxBlockToInsert->xBlockSize += pxIterator->pxNextFreeBlock->xBlockSize;
-            pxBlockToInsert->pxNextFreeBlock = pxIterator->pxNextFreeBlock->pxNextFreeBlock;
+            mem_backend->get_stats(mem_backend->context, (lwcan_mem_class_t)i, &heap_stats);
         }
-        else
+
+        stats->total_size += heap_stats.total_size;
+        stats->free_size += heap_stats.free_size;
+        stats->minimum_ever_free_size += heap_stats.minimum_ever_free_size;
+        stats->free_blocks += heap_stats.free_blocks;
+        stats->allocations += heap_stats.allocations;
+        stats->frees += heap_stats.frees;
+        stats->failed_allocations += mem_failed_allocations[i];
+
+        if (heap_stats.largest_free_block > stats->largest_free_block)
         {
-            pxBlockToInsert->pxNextFreeBlock = pxEnd;
+            stats->largest_free_block = heap_stats.largest_free_block;
         }
     }
-    else
+
+    mem_calculate_fragmentation(stats);
+
+    return ERROR_OK;
+}
+
+lwcanerr_t lwcan_mem_get_class_stats(lwcan_mem_class_t mem_class, struct lwcan_mem_stats *stats)
+{
+    if (mem_class >= LWCAN_MEM_CLASS_MAX || stats == NULL)
+    {
+        LWCAN_ASSERT("mem_class < LWCAN_MEM_CLASS_MAX", mem_class < LWCAN_MEM_CLASS_MAX);
+        LWCAN_ASSERT("stats != NULL", stats != NULL);
+
+        return ERROR_ARG;
+    }
+
+    memset(stats, 0, sizeof(struct lwcan_mem_stats));
+
+    if (mem_backend->get_stats != NULL)
+    {
+        mem_backend->get_stats(mem_backend->context, mem_class, stats);
+    }
+
+    stats->failed_allocations = mem_failed_allocations[mem_class];
+
+    mem_calculate_fragmentation(stats);
+
+    return ERROR_OK;
+}
+
+size_t lwcan_mem_get_free_size(lwcan_mem_class_t mem_class)
+{
+    struct lwcan_mem_stats stats;
+
+    if (mem_class >= LWCAN_MEM_CLASS_MAX)
     {
-        pxBlockToInsert->pxNextFreeBlock = pxIterator->pxNextFreeBlock;
+        LWCAN_ASSERT("mem_class < LWCAN_MEM_CLASS_MAX", mem_class < LWCAN_MEM_CLASS_MAX);
+
+        return 0;
     }
 
-    /* If the block being inserted plugged a gab, so was merged with the block
-     * before and the block after, then it's pxNextFreeBlock pointer will have
-     * already been set, and should not be set here as that would make it point
-     * to itself. */
-    if (pxIterator != pxBlockToInsert)
+    if (mem_backend == &mem_heap_backend)
     {
-        pxIterator->pxNextFreeBlock = pxBlockToInsert;
+        mem_init();
+
+        return lwcan_heap_free_size(mem_get_heap(mem_class));
     }
+
+    if (mem_backend->get_stats == NULL)
+    {
+        return 0;
+    }
+
+    memset(&stats, 0, sizeof(struct lwcan_mem_stats));
+
+    mem_backend->get_stats(mem_backend->context, mem_class, &stats);
+
+    return stats.free_size;
+}
+
+#if LWCAN_MEM_OWNER_STATS
+lwcanerr_t lwcan_mem_get_owner_stats(lwcan_mem_owner_t owner, struct lwcan_mem_owner_stats *stats)
+{
+    if (owner >= LWCAN_MEM_OWNER_MAX || stats == NULL)
+    {
+        LWCAN_ASSERT("owner < LWCAN_MEM_OWNER_MAX", owner < LWCAN_MEM_OWNER_MAX);
+        LWCAN_ASSERT("stats != NULL", stats != NULL);
+
+        return ERROR_ARG;
+    }
+
+    memcpy(stats, &mem_owner_stats[owner], sizeof(struct lwcan_mem_owner_stats));
+
+    return ERROR_OK;
 }
-/*-----------------------------------------------------------*/
+#endif
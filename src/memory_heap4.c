@@ -0,0 +1,454 @@
+#include "lwcan/options.h"
+
+#if !LWCAN_MEM_TLSF /* the TLSF heap in memory_tlsf.c is used instead if configured in lwcan_options.h */
+
+#include "lwcan/memory.h"
+#include "lwcan/private/memory_private.h"
+#include "lwcan/error.h"
+#include "lwcan/debug.h"
+
+#define MEMORY_BYTE_ALIGNMENT 8
+
+#define MEMORY_BYTE_ALIGNMENT_MASK (0x0007)
+
+/* Block sizes must not get too small. */
+#define MEMORY_HEAP_MINIMUM_BLOCK_SIZE ((size_t)(xHeapStructSize << 1))
+
+/* Assumes 8bit bytes! */
+#define MEMORY_HEAP_BITS_PER_BYTE ((size_t)8)
+
+/* Gets set to the top bit of an size_t type.  When this bit in the xBlockSize
+ * member of an BlockLink_t structure is set then the block belongs to the
+ * application.  When the bit is free the block is still part of the free heap
+ * space. */
+#define MEMORY_HEAP_BLOCK_ALLOCATED_BIT (((size_t)1) << ((sizeof(size_t) * MEMORY_HEAP_BITS_PER_BYTE) - 1))
+
+/* Define the linked list structure.  This is used to link free blocks in order
+ * of their memory address. */
+typedef struct A_BLOCK_LINK
+{
+    struct A_BLOCK_LINK *pxNextFreeBlock; /*<< The next free block in the list. */
+
+    size_t xBlockSize;                    /*<< The size of the free block. */
+} BlockLink_t;
+
+/* One heap per allocation class.  Like FreeRTOS heap_5 a heap can be made of
+ * several regions, their free blocks all live in the same address ordered list. */
+typedef struct A_HEAP
+{
+    /* List links to mark the start and end of the list.  The end marker lives
+     * outside of the regions so they can be added in any order. */
+    BlockLink_t xStart, xEnd;
+
+    /* Keeps track of the number of calls to allocate and free memory as well as the
+     * number of free bytes remaining, but says nothing about fragmentation. */
+    size_t xFreeBytesRemaining;
+    size_t xMinimumEverFreeBytesRemaining;
+    size_t xNumberOfSuccessfulAllocations;
+    size_t xNumberOfSuccessfulFrees;
+
+    /* Usable size of all regions once they have been aligned. */
+    size_t xTotalHeapBytes;
+} Heap_t;
+
+/*
+ * Inserts a block of memory that is being freed into the correct position in
+ * the list of free memory blocks.  The block being freed will be merged with
+ * the block in front it and/or the block behind it if the memory blocks are
+ * adjacent to each other.
+ */
+static void prvInsertBlockIntoFreeList(Heap_t *pxHeap, BlockLink_t *pxBlockToInsert);
+
+/*-----------------------------------------------------------*/
+
+/* The size of the structure placed at the beginning of each allocated memory
+ * block must by correctly byte aligned. */
+static const size_t xHeapStructSize = (sizeof(BlockLink_t) + ((size_t)(MEMORY_BYTE_ALIGNMENT - 1))) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+
+static Heap_t xHeaps[LWCAN_MEM_CLASS_MAX];
+
+/*-----------------------------------------------------------*/
+
+void *lwcan_heap_malloc(uint8_t heap, size_t size)
+{
+    Heap_t *pxHeap;
+    BlockLink_t *pxBlock, *pxPreviousBlock, *pxNewBlockLink;
+    void *pvReturn = NULL;
+
+    pxHeap = &xHeaps[heap];
+
+    {
+        /* Check the requested block size is not so large that the top bit is
+         * set.  The top bit of the block size member of the BlockLink_t structure
+         * is used to determine who owns the block - the application or the
+         * kernel, so it must be free. */
+        if ((size & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) == 0)
+        {
+            /* The wanted size must be increased so it can contain a BlockLink_t
+             * structure in addition to the requested amount of bytes. */
+            if ((size > 0) &&
+                ((size + xHeapStructSize) > size)) /* Overflow check */
+            {
+                size += xHeapStructSize;
+
+                /* Ensure that blocks are always aligned. */
+                if ((size & MEMORY_BYTE_ALIGNMENT_MASK) != 0x00)
+                {
+                    /* Byte alignment required. Check for overflow. */
+                    if ((size + (MEMORY_BYTE_ALIGNMENT - (size & MEMORY_BYTE_ALIGNMENT_MASK))) > size)
+                    {
+                        size += (MEMORY_BYTE_ALIGNMENT - (size & MEMORY_BYTE_ALIGNMENT_MASK));
+                        LWCAN_ASSERT("(size & MEMORY_BYTE_ALIGNMENT_MASK) == 0", (size & MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+                    }
+                    else
+                    {
+                        size = 0;
+                    }
+                }
+            }
+            else
+            {
+                size = 0;
+            }
+
+            if ((size > 0) && (size <= pxHeap->xFreeBytesRemaining))
+            {
+                /* Traverse the list from the start  (lowest address) block until
+                 * one of adequate size is found. */
+                pxPreviousBlock = &pxHeap->xStart;
+                pxBlock = pxHeap->xStart.pxNextFreeBlock;
+
+                while ((pxBlock->xBlockSize < size) && (pxBlock->pxNextFreeBlock != NULL))
+                {
+                    pxPreviousBlock = pxBlock;
+                    pxBlock = pxBlock->pxNextFreeBlock;
+                }
+
+                /* If the end marker was reached then a block of adequate size
+                 * was not found. */
+                if (pxBlock != &pxHeap->xEnd)
+                {
+                    /* Return the memory space pointed to - jumping over the
+                     * BlockLink_t structure at its start. */
+                    pvReturn = (void *)(((uint8_t *)pxPreviousBlock->pxNextFreeBlock) + xHeapStructSize);
+
+                    /* This block is being returned for use so must be taken out
+                     * of the list of free blocks. */
+                    pxPreviousBlock->pxNextFreeBlock = pxBlock->pxNextFreeBlock;
+
+                    /* If the block is larger than required it can be split into
+                     * two. */
+                    if ((pxBlock->xBlockSize - size) > MEMORY_HEAP_MINIMUM_BLOCK_SIZE)
+                    {
+                        /* This block is to be split into two.  Create a new
+                         * block following the number of bytes requested. The void
+                         * cast is used to prevent byte alignment warnings from the
+                         * compiler. */
+                        pxNewBlockLink = (void *)(((uint8_t *)pxBlock) + size);
+                        LWCAN_ASSERT("(((size_t)pxNewBlockLink) & MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)pxNewBlockLink) & MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+
+                        /* Calculate the sizes of two blocks split from the
+                         * single block. */
+                        pxNewBlockLink->xBlockSize = pxBlock->xBlockSize - size;
+                        pxBlock->xBlockSize = size;
+
+                        /* Insert the new block into the list of free blocks. */
+                        prvInsertBlockIntoFreeList(pxHeap, pxNewBlockLink);
+                    }
+
+                    pxHeap->xFreeBytesRemaining -= pxBlock->xBlockSize;
+
+                    if (pxHeap->xFreeBytesRemaining < pxHeap->xMinimumEverFreeBytesRemaining)
+                    {
+                        pxHeap->xMinimumEverFreeBytesRemaining = pxHeap->xFreeBytesRemaining;
+                    }
+
+                    /* The block is being returned - it is allocated and owned
+                     * by the application and has no "next" block. */
+                    pxBlock->xBlockSize |= MEMORY_HEAP_BLOCK_ALLOCATED_BIT;
+                    pxBlock->pxNextFreeBlock = NULL;
+                    pxHeap->xNumberOfSuccessfulAllocations++;
+                }
+            }
+        }
+
+    }
+
+    LWCAN_ASSERT("(((size_t)pvReturn) & (size_t)MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)pvReturn) & (size_t)MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+
+    return pvReturn;
+}
+/*-----------------------------------------------------------*/
+
+void lwcan_heap_free(uint8_t heap, void *p)
+{
+    Heap_t *pxHeap;
+    uint8_t *puc = (uint8_t *)p;
+
+    BlockLink_t *pxLink;
+
+    pxHeap = &xHeaps[heap];
+
+    if (p != NULL)
+    {
+        /* The memory being freed will have an BlockLink_t structure immediately
+         * before it. */
+        puc -= xHeapStructSize;
+
+        /* This casting is to keep the compiler from issuing warnings. */
+        pxLink = (void *)puc;
+
+        /* Check the block is actually allocated. */
+
+        LWCAN_ASSERT("(pxLink->xBlockSize & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) != 0", (pxLink->xBlockSize & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) != 0);
+
+        LWCAN_ASSERT("pxLink->pxNextFreeBlock == NULL", pxLink->pxNextFreeBlock == NULL);
+
+        if ((pxLink->xBlockSize & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) != 0)
+        {
+            if (pxLink->pxNextFreeBlock == NULL)
+            {
+                /* The block is being returned to the heap - it is no longer
+                 * allocated. */
+                pxLink->xBlockSize &= ~MEMORY_HEAP_BLOCK_ALLOCATED_BIT;
+
+                {
+                    /* Add this block to the list of free blocks. */
+                    pxHeap->xFreeBytesRemaining += pxLink->xBlockSize;
+
+                    prvInsertBlockIntoFreeList(pxHeap, ((BlockLink_t *)pxLink));
+
+                    pxHeap->xNumberOfSuccessfulFrees++;
+                }
+            }
+        }
+    }
+}
+/*-----------------------------------------------------------*/
+
+size_t lwcan_heap_usable_size(uint8_t heap, void *p)
+{
+    BlockLink_t *pxLink;
+
+    (void)heap;
+
+    /* The memory has an BlockLink_t structure immediately before it. */
+    pxLink = (void *)((uint8_t *)p - xHeapStructSize);
+
+    return (pxLink->xBlockSize & ~MEMORY_HEAP_BLOCK_ALLOCATED_BIT) - xHeapStructSize;
+}
+/*-----------------------------------------------------------*/
+
+uint8_t lwcan_heap_resize(uint8_t heap, void *p, size_t size)
+{
+    Heap_t *pxHeap;
+    BlockLink_t *pxLink, *pxBlock, *pxPreviousBlock, *pxNewBlockLink;
+    size_t xBlockSize;
+
+    pxHeap = &xHeaps[heap];
+
+    /* The memory has an BlockLink_t structure immediately before it. */
+    pxLink = (void *)((uint8_t *)p - xHeapStructSize);
+
+    LWCAN_ASSERT("(pxLink->xBlockSize & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) != 0", (pxLink->xBlockSize & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) != 0);
+
+    xBlockSize = pxLink->xBlockSize & ~MEMORY_HEAP_BLOCK_ALLOCATED_BIT;
+
+    /* The wanted size is worked out the same way lwcan_heap_malloc() does it. */
+    if ((size == 0) || (size & MEMORY_HEAP_BLOCK_ALLOCATED_BIT) != 0 ||
+        (size + xHeapStructSize + MEMORY_BYTE_ALIGNMENT) < size) /* Overflow check */
+    {
+        return 0;
+    }
+
+    size = (size + xHeapStructSize + (MEMORY_BYTE_ALIGNMENT - 1)) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+
+    if (size > xBlockSize)
+    {
+        /* Growing is only possible into a free block which starts right where
+         * this one ends.  The free list is sorted by address, so the walk can
+         * stop at the first block past the end of this one. */
+        pxPreviousBlock = &pxHeap->xStart;
+        pxBlock = pxHeap->xStart.pxNextFreeBlock;
+
+        while ((pxBlock != &pxHeap->xEnd) && ((uint8_t *)pxBlock < ((uint8_t *)pxLink + xBlockSize)))
+        {
+            pxPreviousBlock = pxBlock;
+            pxBlock = pxBlock->pxNextFreeBlock;
+        }
+
+        if ((pxBlock == &pxHeap->xEnd) || ((uint8_t *)pxBlock != ((uint8_t *)pxLink + xBlockSize)) ||
+            ((xBlockSize + pxBlock->xBlockSize) < size))
+        {
+            return 0;
+        }
+
+        /* Take the neighbour out of the list of free blocks and absorb it. */
+        pxPreviousBlock->pxNextFreeBlock = pxBlock->pxNextFreeBlock;
+
+        pxHeap->xFreeBytesRemaining -= pxBlock->xBlockSize;
+
+        xBlockSize += pxBlock->xBlockSize;
+    }
+
+    /* If the block is now larger than required the tail is given back. */
+    if ((xBlockSize - size) > MEMORY_HEAP_MINIMUM_BLOCK_SIZE)
+    {
+        pxNewBlockLink = (void *)(((uint8_t *)pxLink) + size);
+        LWCAN_ASSERT("(((size_t)pxNewBlockLink) & MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)pxNewBlockLink) & MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+
+        pxNewBlockLink->xBlockSize = xBlockSize - size;
+        xBlockSize = size;
+
+        pxHeap->xFreeBytesRemaining += pxNewBlockLink->xBlockSize;
+
+        prvInsertBlockIntoFreeList(pxHeap, pxNewBlockLink);
+    }
+
+    if (pxHeap->xFreeBytesRemaining < pxHeap->xMinimumEverFreeBytesRemaining)
+    {
+        pxHeap->xMinimumEverFreeBytesRemaining = pxHeap->xFreeBytesRemaining;
+    }
+
+    pxLink->xBlockSize = xBlockSize | MEMORY_HEAP_BLOCK_ALLOCATED_BIT;
+
+    return 1;
+}
+/*-----------------------------------------------------------*/
+
+void lwcan_heap_add_region(uint8_t heap, void *start, size_t size)
+{
+    Heap_t *pxHeap;
+    BlockLink_t *pxFirstFreeBlock;
+    size_t uxAddress;
+
+    pxHeap = &xHeaps[heap];
+
+    /* The first region of a heap sets up the list of free blocks. */
+    if (pxHeap->xStart.pxNextFreeBlock == NULL)
+    {
+        pxHeap->xStart.pxNextFreeBlock = &pxHeap->xEnd;
+        pxHeap->xStart.xBlockSize = (size_t)0;
+        pxHeap->xEnd.pxNextFreeBlock = NULL;
+        pxHeap->xEnd.xBlockSize = (size_t)0;
+    }
+
+    /* Ensure the region starts on a correctly aligned boundary. */
+    uxAddress = (size_t)start;
+
+    if ((uxAddress & MEMORY_BYTE_ALIGNMENT_MASK) != 0)
+    {
+        uxAddress += (MEMORY_BYTE_ALIGNMENT - 1);
+        uxAddress &= ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+        size -= uxAddress - (size_t)start;
+    }
+
+    size &= ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+
+    /* The whole region becomes a single free block, it is merged with the
+     * blocks of other regions of the heap if they happen to be adjacent. */
+    pxFirstFreeBlock = (void *)uxAddress;
+    pxFirstFreeBlock->xBlockSize = size;
+    pxFirstFreeBlock->pxNextFreeBlock = NULL;
+
+    pxHeap->xFreeBytesRemaining += size;
+    pxHeap->xMinimumEverFreeBytesRemaining += size;
+    pxHeap->xTotalHeapBytes += size;
+
+    prvInsertBlockIntoFreeList(pxHeap, pxFirstFreeBlock);
+}
+/*-----------------------------------------------------------*/
+
+size_t lwcan_heap_free_size(uint8_t heap)
+{
+    return xHeaps[heap].xFreeBytesRemaining;
+}
+/*-----------------------------------------------------------*/
+
+void lwcan_heap_get_stats(uint8_t heap, struct lwcan_mem_stats *stats)
+{
+    Heap_t *pxHeap;
+    BlockLink_t *pxBlock;
+
+    pxHeap = &xHeaps[heap];
+
+    stats->total_size = pxHeap->xTotalHeapBytes;
+    stats->free_size = pxHeap->xFreeBytesRemaining;
+    stats->minimum_ever_free_size = pxHeap->xMinimumEverFreeBytesRemaining;
+    stats->largest_free_block = 0;
+    stats->free_blocks = 0;
+    stats->allocations = pxHeap->xNumberOfSuccessfulAllocations;
+    stats->frees = pxHeap->xNumberOfSuccessfulFrees;
+
+    /* The free list is walked here rather than kept up to date on every
+     * allocation, this is a diagnostic call and not on the data path. */
+    for (pxBlock = pxHeap->xStart.pxNextFreeBlock; pxBlock != &pxHeap->xEnd && pxBlock != NULL; pxBlock = pxBlock->pxNextFreeBlock)
+    {
+        if (pxBlock->xBlockSize > stats->largest_free_block)
+        {
+            stats->largest_free_block = pxBlock->xBlockSize;
+        }
+
+        stats->free_blocks++;
+    }
+}
+/*-----------------------------------------------------------*/
+
+static void prvInsertBlockIntoFreeList(Heap_t *pxHeap, BlockLink_t *pxBlockToInsert) /*  */
+{
+    BlockLink_t *pxIterator;
+    BlockLink_t *pxEnd = &pxHeap->xEnd;
+    uint8_t *puc;
+
+    /* Iterate through the list until a block is found that has a higher address
+     * than the block being inserted.  The end marker is not part of any region,
+     * so it terminates the walk regardless of its address. */
+    for (pxIterator = &pxHeap->xStart; (pxIterator->pxNextFreeBlock != pxEnd) && (pxIterator->pxNextFreeBlock < pxBlockToInsert); pxIterator = pxIterator->pxNextFreeBlock)
+    {
+        /* Nothing to do here, just iterate to the right position. */
+    }
+
+    /* Do the block being inserted, and the block it is being inserted after
+     * make a contiguous block of memory? */
+    puc = (uint8_t *)pxIterator;
+
+    if ((pxIterator != &pxHeap->xStart) && ((puc + pxIterator->xBlockSize) == (uint8_t *)pxBlockToInsert))
+    {
+        pxIterator->xBlockSize += pxBlockToInsert->xBlockSize;
+        pxBlockToInsert = pxIterator;
+    }
+
+    /* Do the block being inserted, and the block it is being inserted before
+     * make a contiguous block of memory? */
+    puc = (uint8_t *)pxBlockToInsert;
+
+    if ((puc + pxBlockToInsert->xBlockSize) == (uint8_t *)pxIterator->pxNextFreeBlock)
+    {
+        if (pxIterator->pxNextFreeBlock != pxEnd)
+        {
+            /* Form one big block from the two blocks. */
+            pxBlockToInsert->xBlockSize += pxIterator->pxNextFreeBlock->xBlockSize;
+            pxBlockToInsert->pxNextFreeBlock = pxIterator->pxNextFreeBlock->pxNextFreeBlock;
+        }
+        else
+        {
+            pxBlockToInsert->pxNextFreeBlock = pxEnd;
+        }
+    }
+    else
+    {
+        pxBlockToInsert->pxNextFreeBlock = pxIterator->pxNextFreeBlock;
+    }
+
+    /* If the block being inserted plugged a gab, so was merged with the block
+     * before and the block after, then it's pxNextFreeBlock pointer will have
+     * already been set, and should not be set here as that would make it point
+     * to itself. */
+    if (pxIterator != pxBlockToInsert)
+    {
+        pxIterator->pxNextFreeBlock = pxBlockToInsert;
+    }
+}
+/*-----------------------------------------------------------*/
+
+#endif
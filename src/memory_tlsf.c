@@ -0,0 +1,619 @@
+#include "lwcan/options.h"
+
+#if LWCAN_MEM_TLSF /* don't build if not configured for use in lwcan_options.h */
+
+#include "lwcan/memory.h"
+#include "lwcan/private/memory_private.h"
+#include "lwcan/error.h"
+#include "lwcan/debug.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MEMORY_BYTE_ALIGNMENT 8
+
+#define MEMORY_BYTE_ALIGNMENT_MASK (0x0007)
+
+#define MEMORY_BYTE_ALIGNMENT_LOG2 3
+
+/* log2 of the number of second level lists per first level class */
+#define TLSF_SL_INDEX_COUNT_LOG2 4
+
+#define TLSF_SL_INDEX_COUNT (1 << TLSF_SL_INDEX_COUNT_LOG2)
+
+/* Blocks smaller than this are all kept in first level class 0 and are split linearly */
+#define TLSF_FL_INDEX_SHIFT (TLSF_SL_INDEX_COUNT_LOG2 + MEMORY_BYTE_ALIGNMENT_LOG2)
+
+#define TLSF_SMALL_BLOCK_SIZE ((size_t)1 << TLSF_FL_INDEX_SHIFT)
+
+/* log2 of the largest block size the heap has to index, derived from the largest region size */
+#if LWCAN_MEM_REGION_SIZE_MAX <= 0x400UL
+#define TLSF_FL_INDEX_MAX 10
+#elif LWCAN_MEM_REGION_SIZE_MAX <= 0x1000UL
+#define TLSF_FL_INDEX_MAX 12
+#elif LWCAN_MEM_REGION_SIZE_MAX <= 0x4000UL
+#define TLSF_FL_INDEX_MAX 14
+#elif LWCAN_MEM_REGION_SIZE_MAX <= 0x10000UL
+#define TLSF_FL_INDEX_MAX 16
+#elif LWCAN_MEM_REGION_SIZE_MAX <= 0x100000UL
+#define TLSF_FL_INDEX_MAX 20
+#elif LWCAN_MEM_REGION_SIZE_MAX <= 0x1000000UL
+#define TLSF_FL_INDEX_MAX 24
+#else
+#define TLSF_FL_INDEX_MAX 31
+#endif
+
+#define TLSF_FL_INDEX_COUNT (TLSF_FL_INDEX_MAX - TLSF_FL_INDEX_SHIFT + 1)
+
+/* Set in the size field of a block which is in one of the free lists */
+#define TLSF_BLOCK_FREE_BIT ((size_t)1)
+
+/*
+ * Every block begins with a header that links it to its physical neighbour.
+ * The free list links are only valid while the block is free, so they are
+ * overlaid on the first bytes of the payload.
+ */
+typedef struct tlsf_block
+{
+    struct tlsf_block *prev_phys; /* Block located immediately before this one in memory */
+
+    size_t size; /* Size of the whole block including the header, lowest bit is TLSF_BLOCK_FREE_BIT */
+
+    struct tlsf_block *next_free; /* Next block in the same free list */
+
+    struct tlsf_block *prev_free; /* Previous block in the same free list */
+} tlsf_block_t;
+
+/* Size of the part of the header which stays in front of an allocated payload */
+#define TLSF_BLOCK_HEADER_SIZE ((offsetof(tlsf_block_t, next_free) + (MEMORY_BYTE_ALIGNMENT - 1)) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK))
+
+/* Free blocks must be able to hold the free list links */
+#define TLSF_BLOCK_SIZE_MIN ((sizeof(tlsf_block_t) + (MEMORY_BYTE_ALIGNMENT - 1)) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK))
+
+#define TLSF_BLOCK_SIZE_MAX (((size_t)1 << TLSF_FL_INDEX_MAX) - 1)
+
+/* One heap per allocation class, each can be made of several regions */
+typedef struct tlsf_heap
+{
+    /* Bitmap of first level classes which have at least one non empty second level list */
+    uint32_t fl_bitmap;
+
+    /* Bitmaps of non empty second level lists, one per first level class */
+    uint32_t sl_bitmap[TLSF_FL_INDEX_COUNT];
+
+    /* Heads of the segregated free lists */
+    tlsf_block_t *free_blocks[TLSF_FL_INDEX_COUNT][TLSF_SL_INDEX_COUNT];
+
+    /* Keeps track of the number of calls to allocate and free memory as well as the
+     * number of free bytes remaining, but says nothing about fragmentation. */
+    size_t free_bytes_remaining;
+    size_t minimum_ever_free_bytes_remaining;
+    size_t successful_allocations;
+    size_t successful_frees;
+
+    /* Usable size of all regions and number of blocks in the free lists */
+    size_t total_heap_size;
+    size_t free_block_count;
+} tlsf_heap_t;
+
+static tlsf_heap_t tlsf_heaps[LWCAN_MEM_CLASS_MAX];
+
+/* Index of the lowest set bit, word must not be zero */
+static inline uint8_t tlsf_ffs(uint32_t word)
+{
+#if defined(__GNUC__)
+    return (uint8_t)__builtin_ctz(word);
+#else
+    uint8_t bit = 0;
+
+    if ((word & 0xFFFF) == 0) { word >>= 16; bit += 16; }
+    if ((word & 0xFF) == 0) { word >>= 8; bit += 8; }
+    if ((word & 0xF) == 0) { word >>= 4; bit += 4; }
+    if ((word & 0x3) == 0) { word >>= 2; bit += 2; }
+    if ((word & 0x1) == 0) { bit += 1; }
+
+    return bit;
+#endif
+}
+
+/* Index of the highest set bit, size must not be zero */
+static inline uint8_t tlsf_fls(size_t size)
+{
+#if defined(__GNUC__)
+    if (sizeof(size_t) > sizeof(unsigned long))
+    {
+        return (uint8_t)((sizeof(unsigned long long) * 8) - 1 - __builtin_clzll((unsigned long long)size));
+    }
+
+    return (uint8_t)((sizeof(unsigned long) * 8) - 1 - __builtin_clzl((unsigned long)size));
+#else
+    uint8_t bit = 0;
+
+    while (size > 1)
+    {
+        size >>= 1;
+        bit += 1;
+    }
+
+    return bit;
+#endif
+}
+
+static inline size_t tlsf_block_size(const tlsf_block_t *block)
+{
+    return block->size & ~TLSF_BLOCK_FREE_BIT;
+}
+
+static inline uint8_t tlsf_block_is_free(const tlsf_block_t *block)
+{
+    return (block->size & TLSF_BLOCK_FREE_BIT) ? 1 : 0;
+}
+
+static inline tlsf_block_t *tlsf_block_next(const tlsf_block_t *block)
+{
+    return (tlsf_block_t *)((uint8_t *)block + tlsf_block_size(block));
+}
+
+/* Compute the free list indexes a block of the given size belongs to */
+static void tlsf_mapping_insert(size_t size, uint8_t *fl, uint8_t *sl)
+{
+    uint8_t f;
+
+    if (size < TLSF_SMALL_BLOCK_SIZE)
+    {
+        *fl = 0;
+
+        *sl = (uint8_t)(size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_INDEX_COUNT));
+
+        return;
+    }
+
+    f = tlsf_fls(size);
+
+    *sl = (uint8_t)((size >> (f - TLSF_SL_INDEX_COUNT_LOG2)) ^ (1 << TLSF_SL_INDEX_COUNT_LOG2));
+
+    *fl = (uint8_t)(f - (TLSF_FL_INDEX_SHIFT - 1));
+}
+
+/* Compute the indexes of the first list whose blocks are all at least the given size */
+static void tlsf_mapping_search(size_t size, uint8_t *fl, uint8_t *sl)
+{
+    if (size >= TLSF_SMALL_BLOCK_SIZE)
+    {
+        size += ((size_t)1 << (tlsf_fls(size) - TLSF_SL_INDEX_COUNT_LOG2)) - 1;
+    }
+
+    tlsf_mapping_insert(size, fl, sl);
+}
+
+static tlsf_block_t *tlsf_search_suitable_block(tlsf_heap_t *heap, uint8_t *fl, uint8_t *sl)
+{
+    uint32_t map;
+
+    if (*fl >= TLSF_FL_INDEX_COUNT)
+    {
+        return NULL;
+    }
+
+    /* First search for a non empty list in the same first level class */
+    map = heap->sl_bitmap[*fl] & (~(uint32_t)0 << *sl);
+
+    if (map == 0)
+    {
+        /* Fall back to the next larger first level class which has free blocks */
+        if ((*fl + 1) >= TLSF_FL_INDEX_COUNT)
+        {
+            return NULL;
+        }
+
+        map = heap->fl_bitmap & (~(uint32_t)0 << (*fl + 1));
+
+        if (map == 0)
+        {
+            return NULL;
+        }
+
+        *fl = tlsf_ffs(map);
+
+        map = heap->sl_bitmap[*fl];
+    }
+
+    *sl = tlsf_ffs(map);
+
+    return heap->free_blocks[*fl][*sl];
+}
+
+static void tlsf_remove_free_block(tlsf_heap_t *heap, tlsf_block_t *block, uint8_t fl, uint8_t sl)
+{
+    if (block->prev_free != NULL)
+    {
+        block->prev_free->next_free = block->next_free;
+    }
+
+    if (block->next_free != NULL)
+    {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (heap->free_blocks[fl][sl] == block)
+    {
+        heap->free_blocks[fl][sl] = block->next_free;
+
+        if (heap->free_blocks[fl][sl] == NULL)
+        {
+            heap->sl_bitmap[fl] &= ~((uint32_t)1 << sl);
+
+            if (heap->sl_bitmap[fl] == 0)
+            {
+                heap->fl_bitmap &= ~((uint32_t)1 << fl);
+            }
+        }
+    }
+
+    heap->free_block_count--;
+
+    block->size &= ~TLSF_BLOCK_FREE_BIT;
+}
+
+static void tlsf_insert_free_block(tlsf_heap_t *heap, tlsf_block_t *block)
+{
+    uint8_t fl, sl;
+
+    tlsf_mapping_insert(tlsf_block_size(block), &fl, &sl);
+
+    block->prev_free = NULL;
+
+    block->next_free = heap->free_blocks[fl][sl];
+
+    if (block->next_free != NULL)
+    {
+        block->next_free->prev_free = block;
+    }
+
+    heap->free_blocks[fl][sl] = block;
+
+    heap->free_block_count++;
+
+    heap->fl_bitmap |= (uint32_t)1 << fl;
+
+    heap->sl_bitmap[fl] |= (uint32_t)1 << sl;
+
+    block->size |= TLSF_BLOCK_FREE_BIT;
+}
+
+static void tlsf_unlink_free_block(tlsf_heap_t *heap, tlsf_block_t *block)
+{
+    uint8_t fl, sl;
+
+    tlsf_mapping_insert(tlsf_block_size(block), &fl, &sl);
+
+    tlsf_remove_free_block(heap, block, fl, sl);
+}
+
+void lwcan_heap_add_region(uint8_t heap_idx, void *start, size_t size)
+{
+    tlsf_heap_t *heap = &tlsf_heaps[heap_idx];
+
+    tlsf_block_t *first_block, *region_end;
+
+    size_t address;
+
+    /* Ensure the region starts on a correctly aligned boundary. */
+    address = (size_t)start;
+
+    if ((address & MEMORY_BYTE_ALIGNMENT_MASK) != 0)
+    {
+        address += (MEMORY_BYTE_ALIGNMENT - 1);
+        address &= ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+        size -= address - (size_t)start;
+    }
+
+    size &= ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+
+    LWCAN_ASSERT("size >= TLSF_BLOCK_SIZE_MIN + TLSF_BLOCK_HEADER_SIZE", size >= TLSF_BLOCK_SIZE_MIN + TLSF_BLOCK_HEADER_SIZE);
+
+    first_block = (tlsf_block_t *)address;
+
+    first_block->prev_phys = NULL;
+
+    first_block->size = size - TLSF_BLOCK_HEADER_SIZE;
+
+    /* Regions larger than LWCAN_MEM_REGION_SIZE_MAX are only used up to it */
+    LWCAN_ASSERT("first_block->size <= TLSF_BLOCK_SIZE_MAX", first_block->size <= TLSF_BLOCK_SIZE_MAX);
+
+    if (first_block->size > TLSF_BLOCK_SIZE_MAX)
+    {
+        first_block->size = TLSF_BLOCK_SIZE_MAX & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+    }
+
+    /* Every region is terminated by a zero sized block which is never free,
+     * so merging stops at it. It only needs the header part. */
+    region_end = tlsf_block_next(first_block);
+    region_end->prev_phys = first_block;
+    region_end->size = 0;
+
+    heap->free_bytes_remaining += first_block->size;
+    heap->minimum_ever_free_bytes_remaining += first_block->size;
+    heap->total_heap_size += first_block->size;
+
+    tlsf_insert_free_block(heap, first_block);
+}
+
+void *lwcan_heap_malloc(uint8_t heap_idx, size_t size)
+{
+    tlsf_heap_t *heap = &tlsf_heaps[heap_idx];
+
+    tlsf_block_t *block, *remaining_block;
+
+    uint8_t fl, sl;
+
+    size_t block_size;
+
+    void *mem = NULL;
+
+    /* The wanted size must be increased so it can contain the block header,
+     * and rounded up so the next block stays aligned. */
+    if (size == 0 || size > (TLSF_BLOCK_SIZE_MAX - TLSF_BLOCK_HEADER_SIZE - MEMORY_BYTE_ALIGNMENT))
+    {
+        return NULL;
+    }
+
+    block_size = (size + TLSF_BLOCK_HEADER_SIZE + (MEMORY_BYTE_ALIGNMENT - 1)) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+
+    if (block_size < TLSF_BLOCK_SIZE_MIN)
+    {
+        block_size = TLSF_BLOCK_SIZE_MIN;
+    }
+
+    if (block_size > heap->free_bytes_remaining)
+    {
+        return NULL;
+    }
+
+    tlsf_mapping_search(block_size, &fl, &sl);
+
+    block = tlsf_search_suitable_block(heap, &fl, &sl);
+
+    if (block == NULL)
+    {
+        /* Rounding the request up to the next list can skip a block which
+         * would fit, which matters for requests close to the heap size.
+         * The head of the list the size itself maps to is checked as a last resort. */
+        tlsf_mapping_insert(block_size, &fl, &sl);
+
+        if (fl >= TLSF_FL_INDEX_COUNT)
+        {
+            return NULL;
+        }
+
+        block = heap->free_blocks[fl][sl];
+
+        if (block == NULL || tlsf_block_size(block) < block_size)
+        {
+            return NULL;
+        }
+    }
+
+    LWCAN_ASSERT("tlsf_block_size(block) >= block_size", tlsf_block_size(block) >= block_size);
+
+    tlsf_remove_free_block(heap, block, fl, sl);
+
+    /* If the block is larger than required it can be split into two. */
+    if ((tlsf_block_size(block) - block_size) >= TLSF_BLOCK_SIZE_MIN)
+    {
+        remaining_block = (tlsf_block_t *)((uint8_t *)block + block_size);
+
+        LWCAN_ASSERT("(((size_t)remaining_block) & MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)remaining_block) & MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+
+        remaining_block->size = tlsf_block_size(block) - block_size;
+        remaining_block->prev_phys = block;
+
+        tlsf_block_next(remaining_block)->prev_phys = remaining_block;
+
+        block->size = block_size;
+
+        tlsf_insert_free_block(heap, remaining_block);
+    }
+
+    heap->free_bytes_remaining -= tlsf_block_size(block);
+
+    if (heap->free_bytes_remaining < heap->minimum_ever_free_bytes_remaining)
+    {
+        heap->minimum_ever_free_bytes_remaining = heap->free_bytes_remaining;
+    }
+
+    heap->successful_allocations++;
+
+    mem = (void *)((uint8_t *)block + TLSF_BLOCK_HEADER_SIZE);
+
+    LWCAN_ASSERT("(((size_t)mem) & (size_t)MEMORY_BYTE_ALIGNMENT_MASK) == 0", (((size_t)mem) & (size_t)MEMORY_BYTE_ALIGNMENT_MASK) == 0);
+
+    return mem;
+}
+
+void lwcan_heap_free(uint8_t heap_idx, void *p)
+{
+    tlsf_heap_t *heap = &tlsf_heaps[heap_idx];
+
+    tlsf_block_t *block, *neighbour;
+
+    if (p == NULL)
+    {
+        return;
+    }
+
+    /* The memory being freed has the block header immediately before it. */
+    block = (tlsf_block_t *)((uint8_t *)p - TLSF_BLOCK_HEADER_SIZE);
+
+    /* Check the block is actually allocated. */
+    LWCAN_ASSERT("!tlsf_block_is_free(block)", !tlsf_block_is_free(block));
+
+    if (tlsf_block_is_free(block) || tlsf_block_size(block) == 0)
+    {
+        return;
+    }
+
+    heap->free_bytes_remaining += tlsf_block_size(block);
+
+    heap->successful_frees++;
+
+    /* Merge with the block in front of it if that one is free. */
+    neighbour = block->prev_phys;
+
+    if (neighbour != NULL && tlsf_block_is_free(neighbour))
+    {
+        tlsf_unlink_free_block(heap, neighbour);
+
+        neighbour->size += tlsf_block_size(block);
+
+        block = neighbour;
+
+        tlsf_block_next(block)->prev_phys = block;
+    }
+
+    /* Merge with the block behind it if that one is free. */
+    neighbour = tlsf_block_next(block);
+
+    if (tlsf_block_is_free(neighbour))
+    {
+        tlsf_unlink_free_block(heap, neighbour);
+
+        block->size += tlsf_block_size(neighbour);
+
+        tlsf_block_next(block)->prev_phys = block;
+    }
+
+    tlsf_insert_free_block(heap, block);
+}
+
+uint8_t lwcan_heap_resize(uint8_t heap_idx, void *p, size_t size)
+{
+    tlsf_heap_t *heap = &tlsf_heaps[heap_idx];
+
+    tlsf_block_t *block, *neighbour, *remaining_block;
+
+    size_t block_size;
+
+    block = (tlsf_block_t *)((uint8_t *)p - TLSF_BLOCK_HEADER_SIZE);
+
+    LWCAN_ASSERT("!tlsf_block_is_free(block)", !tlsf_block_is_free(block));
+
+    if (size == 0 || size > (TLSF_BLOCK_SIZE_MAX - TLSF_BLOCK_HEADER_SIZE - MEMORY_BYTE_ALIGNMENT))
+    {
+        return 0;
+    }
+
+    block_size = (size + TLSF_BLOCK_HEADER_SIZE + (MEMORY_BYTE_ALIGNMENT - 1)) & ~((size_t)MEMORY_BYTE_ALIGNMENT_MASK);
+
+    if (block_size < TLSF_BLOCK_SIZE_MIN)
+    {
+        block_size = TLSF_BLOCK_SIZE_MIN;
+    }
+
+    /* Growing is only possible into the block behind this one if it is free. */
+    if (block_size > tlsf_block_size(block))
+    {
+        neighbour = tlsf_block_next(block);
+
+        if (!tlsf_block_is_free(neighbour) || (tlsf_block_size(block) + tlsf_block_size(neighbour)) < block_size)
+        {
+            return 0;
+        }
+
+        tlsf_unlink_free_block(heap, neighbour);
+
+        heap->free_bytes_remaining -= tlsf_block_size(neighbour);
+
+        block->size += tlsf_block_size(neighbour);
+
+        tlsf_block_next(block)->prev_phys = block;
+    }
+
+    /* If the block is now larger than required the tail is given back,
+     * merged with the block behind it if that one is free. */
+    if ((tlsf_block_size(block) - block_size) >= TLSF_BLOCK_SIZE_MIN)
+    {
+        remaining_block = (tlsf_block_t *)((uint8_t *)block + block_size);
+
+        remaining_block->size = tlsf_block_size(block) - block_size;
+        remaining_block->prev_phys = block;
+
+        block->size = block_size;
+
+        heap->free_bytes_remaining += tlsf_block_size(remaining_block);
+
+        neighbour = tlsf_block_next(remaining_block);
+
+        if (tlsf_block_is_free(neighbour))
+        {
+            tlsf_unlink_free_block(heap, neighbour);
+
+            remaining_block->size += tlsf_block_size(neighbour);
+        }
+
+        tlsf_block_next(remaining_block)->prev_phys = remaining_block;
+
+        tlsf_insert_free_block(heap, remaining_block);
+    }
+
+    if (heap->free_bytes_remaining < heap->minimum_ever_free_bytes_remaining)
+    {
+        heap->minimum_ever_free_bytes_remaining = heap->free_bytes_remaining;
+    }
+
+    return 1;
+}
+
+size_t lwcan_heap_usable_size(uint8_t heap_idx, void *p)
+{
+    tlsf_block_t *block;
+
+    (void)heap_idx;
+
+    block = (tlsf_block_t *)((uint8_t *)p - TLSF_BLOCK_HEADER_SIZE);
+
+    return tlsf_block_size(block) - TLSF_BLOCK_HEADER_SIZE;
+}
+
+size_t lwcan_heap_free_size(uint8_t heap_idx)
+{
+    return tlsf_heaps[heap_idx].free_bytes_remaining;
+}
+
+void lwcan_heap_get_stats(uint8_t heap_idx, struct lwcan_mem_stats *stats)
+{
+    tlsf_heap_t *heap = &tlsf_heaps[heap_idx];
+
+    tlsf_block_t *block;
+
+    uint8_t fl, sl;
+
+    stats->total_size = heap->total_heap_size;
+    stats->free_size = heap->free_bytes_remaining;
+    stats->minimum_ever_free_size = heap->minimum_ever_free_bytes_remaining;
+    stats->largest_free_block = 0;
+    stats->free_blocks = heap->free_block_count;
+    stats->allocations = heap->successful_allocations;
+    stats->frees = heap->successful_frees;
+
+    if (heap->fl_bitmap == 0)
+    {
+        return;
+    }
+
+    /* The largest block is in the highest non empty list, only that list has to be walked */
+    fl = (uint8_t)tlsf_fls(heap->fl_bitmap);
+
+    sl = (uint8_t)tlsf_fls(heap->sl_bitmap[fl]);
+
+    for (block = heap->free_blocks[fl][sl]; block != NULL; block = block->next_free)
+    {
+        if (tlsf_block_size(block) > stats->largest_free_block)
+        {
+            stats->largest_free_block = tlsf_block_size(block);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include "lwcan/memp.h"
+#include "lwcan/private/memp_private.h"
+#include "lwcan/private/timeouts_private.h"
+#include "lwcan/private/buffer_private.h"
+#include "lwcan/options.h"
+#include "lwcan/debug.h"
+
+#if LWCAN_ISOTP
+#include "lwcan/isotp.h"
+#endif
+
+#if LWCAN_RAW
+#include "lwcan/raw.h"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#define MEMP_ALIGNMENT 8
+
+#define MEMP_ALIGN_SIZE(size) (((size) + MEMP_ALIGNMENT - 1U) & ~((size_t)MEMP_ALIGNMENT - 1U))
+
+/* Free elements are linked through their first bytes */
+struct memp
+{
+    struct memp *next;
+};
+
+struct memp_desc
+{
+    const char *desc; /** Pool name for debugging */
+
+    uint8_t *base; /** Pool storage, aligned in lwcan_memp_init */
+
+    size_t size; /** Element size rounded up to MEMP_ALIGNMENT */
+
+    uint16_t num; /** Number of elements */
+
+    struct memp **tab; /** Head of the free list */
+
+    struct lwcan_memp_stats *stats;
+};
+
+#define MEMP_ELEMENT_SIZE(size) MEMP_ALIGN_SIZE((size) < sizeof(struct memp) ? sizeof(struct memp) : (size))
+
+#define LWCAN_MEMPOOL(name, num, size, desc)                                                     \
+    static uint8_t memp_memory_##name[((num) * MEMP_ELEMENT_SIZE(size)) + MEMP_ALIGNMENT - 1]; \
+    static struct memp *memp_tab_##name;                                                       \
+    static struct lwcan_memp_stats memp_stats_##name;
+#include "lwcan/private/memp_std.h"
+
+static struct memp_desc memp_pools[LWCAN_MEMP_MAX] = {
+#define LWCAN_MEMPOOL(name, num, size, desc) {desc, memp_memory_##name, MEMP_ELEMENT_SIZE(size), (num), &memp_tab_##name, &memp_stats_##name},
+#include "lwcan/private/memp_std.h"
+};
+
+void lwcan_memp_init(void)
+{
+    struct memp_desc *pool;
+
+    struct memp *element;
+
+    size_t address;
+
+    for (uint8_t i = 0; i < LWCAN_MEMP_MAX; i++)
+    {
+        pool = &memp_pools[i];
+
+        /* The storage is declared as a byte array, so it is aligned here once */
+        address = (size_t)pool->base;
+
+        if ((address & (MEMP_ALIGNMENT - 1)) != 0)
+        {
+            address = MEMP_ALIGN_SIZE(address);
+
+            pool->base = (uint8_t *)address;
+        }
+
+        *pool->tab = NULL;
+
+        /* Link the elements in reverse so the first element is handed out first */
+        for (uint16_t j = pool->num; j > 0; j--)
+        {
+            element = (struct memp *)(pool->base + ((size_t)(j - 1) * pool->size));
+
+            element->next = *pool->tab;
+
+            *pool->tab = element;
+        }
+
+        memset(pool->stats, 0, sizeof(struct lwcan_memp_stats));
+
+        pool->stats->avail = pool->num;
+    }
+}
+
+void *lwcan_memp_malloc(lwcan_memp_t type)
+{
+    struct memp_desc *pool;
+
+    struct memp *element;
+
+    if (type >= LWCAN_MEMP_MAX)
+    {
+        LWCAN_ASSERT("type < LWCAN_MEMP_MAX", type < LWCAN_MEMP_MAX);
+
+        return NULL;
+    }
+
+    pool = &memp_pools[type];
+
+    element = *pool->tab;
+
+    if (element == NULL)
+    {
+        pool->stats->err++;
+
+        return NULL;
+    }
+
+    *pool->tab = element->next;
+
+    pool->stats->used++;
+
+    if (pool->stats->used > pool->stats->max)
+    {
+        pool->stats->max = pool->stats->used;
+    }
+
+    return (void *)element;
+}
+
+void lwcan_memp_free(lwcan_memp_t type, void *mem)
+{
+    struct memp_desc *pool;
+
+    struct memp *element;
+
+    size_t offset;
+
+    if (type >= LWCAN_MEMP_MAX || mem == NULL)
+    {
+        return;
+    }
+
+    pool = &memp_pools[type];
+
+    /* Checking an address for inclusion in a memory pool */
+    if ((uint8_t *)mem < pool->base || (uint8_t *)mem >= (pool->base + ((size_t)pool->num * pool->size)))
+    {
+        LWCAN_ASSERT("mem belongs to the pool", 0);
+
+        return;
+    }
+
+    /* get address within memory pool and check it for multiple of element size */
+    offset = (size_t)((uint8_t *)mem - pool->base);
+
+    if ((offset % pool->size) != 0)
+    {
+        LWCAN_ASSERT("(offset % pool->size) == 0", (offset % pool->size) == 0);
+
+        return;
+    }
+
+    element = (struct memp *)mem;
+
+    element->next = *pool->tab;
+
+    *pool->tab = element;
+
+    pool->stats->used--;
+}
+
+const char *lwcan_memp_get_name(lwcan_memp_t type)
+{
+    if (type >= LWCAN_MEMP_MAX)
+    {
+        LWCAN_ASSERT("type < LWCAN_MEMP_MAX", type < LWCAN_MEMP_MAX);
+
+        return NULL;
+    }
+
+    return memp_pools[type].desc;
+}
+
+lwcanerr_t lwcan_memp_get_stats(lwcan_memp_t type, struct lwcan_memp_stats *stats)
+{
+    if (type >= LWCAN_MEMP_MAX || stats == NULL)
+    {
+        LWCAN_ASSERT("type < LWCAN_MEMP_MAX", type < LWCAN_MEMP_MAX);
+        LWCAN_ASSERT("stats != NULL", stats != NULL);
+
+        return ERROR_ARG;
+    }
+
+    memcpy(stats, memp_pools[type].stats, sizeof(struct lwcan_memp_stats));
+
+    return ERROR_OK;
+}
@@ -4,76 +4,18 @@
 
 #include "lwcan/raw.h"
 #include "lwcan/private/raw_private.h"
+#include "lwcan/private/memp_private.h"
 #include "lwcan/timeouts.h"
 #include "lwcan/debug.h"
 
 #include <string.h>
 
-#define CANRAW_MEM_CHUNK_SIZE sizeof(struct canraw_pcb)
-
-#define CANRAW_MEM_POOL_SIZE (CANRAW_MEM_CHUNK_SIZE * CANRAW_MAX_PCB_NUM)
-
-#define CANRAW_MEM_POOL_BEGIN_ADDR (uint8_t *)(&canraw_mem_pool[0])
-
-#define CANRAW_MEM_POOL_END_ADDR (uint8_t *)(&canraw_mem_pool[CANRAW_MEM_POOL_SIZE - 1])
-
-#define CANRAW_MEM_POOL_SERVICE_BEGIN_IDX CANRAW_MEM_POOL_SIZE
-
-#define CANRAW_MEM_POOL_SERVICE_END_IDX ((CANRAW_MEM_POOL_SIZE + CANRAW_MAX_PCB_NUM) - 1)
-
-static uint8_t canraw_mem_pool[CANRAW_MEM_POOL_SIZE + CANRAW_MAX_PCB_NUM];
-
 static struct canraw_pcb *canraw_pcb_list;
 
 static uint8_t canraw_pcb_num;
 
-static void *canraw_pcb_malloc(void)
-{
-    for (uint16_t i = CANRAW_MEM_POOL_SERVICE_BEGIN_IDX; i <= CANRAW_MEM_POOL_SERVICE_END_IDX; i++)
-    {
-        if (canraw_mem_pool[i] == 0)
-        {
-            canraw_mem_pool[i] = 0xAA;
-
-            return (void *)&canraw_mem_pool[(i - CANRAW_MEM_POOL_SERVICE_BEGIN_IDX)  * CANRAW_MEM_CHUNK_SIZE];
-        }
-    }
-
-    return NULL;
-}
-
-static void canraw_pcb_free(void *mem)
-{
-    uint16_t idx;
-
-    uint8_t addr;
-
-    /* Checking an address for inclusion in a memory pool */
-    if (mem == NULL || (uint8_t *)mem < CANRAW_MEM_POOL_BEGIN_ADDR || (uint8_t *)mem > CANRAW_MEM_POOL_END_ADDR)
-    {
-        return;
-    }
-
-    /* get address within memory pool */
-    addr = (uint8_t *)mem - CANRAW_MEM_POOL_BEGIN_ADDR;
-
-    /* check address for multiple of chunk size */
-    if ((addr % CANRAW_MEM_CHUNK_SIZE) != 0)
-    {
-        return;
-    }
-
-    /* get the index of the element which means that the chunk has been allocated */
-    idx = CANRAW_MEM_POOL_SERVICE_BEGIN_IDX + (addr / CANRAW_MEM_CHUNK_SIZE);
-
-    /* freeing the chunk */
-    canraw_mem_pool[idx] = 0;
-}
-
 void canraw_init(void)
 {
-    memset(canraw_mem_pool, 0, sizeof(canraw_mem_pool));
-
     canraw_pcb_list = NULL;
 
     canraw_pcb_num = 0;
@@ -90,7 +32,7 @@ struct canraw_pcb *canraw_new(void)
         return NULL;
     }
 
-    pcb = (struct canraw_pcb *)canraw_pcb_malloc();
+    pcb = (struct canraw_pcb *)lwcan_memp_malloc(LWCAN_MEMP_CANRAW_PCB);
 
     if (pcb == NULL)
     {
@@ -133,13 +75,21 @@ lwcanerr_t canraw_bind(struct canraw_pcb *pcb, struct addr_can *addr)
     return ERROR_OK;
 }
 
-void canraw_remove(struct canraw_pcb *pcb)
+lwcanerr_t canraw_remove(struct canraw_pcb *pcb)
 {
     struct canraw_pcb *pcb_temp;
 
     if (pcb == NULL)
     {
-        return;
+        LWCAN_ASSERT("pcb != NULL", pcb != NULL);
+
+        return ERROR_ARG;
+    }
+
+    /* The interface still holds the pcb as the argument of the batch completions */
+    if (pcb->batch_pending != 0)
+    {
+        return ERROR_INPROGRESS;
     }
 
     if (canraw_pcb_list == pcb)
@@ -160,13 +110,15 @@ void canraw_remove(struct canraw_pcb *pcb)
 
         if (pcb_temp == NULL)
         {
-            return;
+            return ERROR_ARG;
         }
     }
 
-    canraw_pcb_free(pcb);
+    lwcan_memp_free(LWCAN_MEMP_CANRAW_PCB, pcb);
 
     canraw_pcb_num -= 1;
+
+    return ERROR_OK;
 }
 
 canraw_input_state_t canraw_input(struct canif *canif, void *frame)
@@ -277,6 +229,145 @@ exit:
     return ret;
 }
 
+static void raw_batch_sent(void *arg, lwcanerr_t error)
+{
+    struct canraw_pcb *pcb;
+
+    pcb = (struct canraw_pcb *)arg;
+
+    /* The first error sticks, the single completion reports it for the whole batch */
+    if (pcb->batch_error == ERROR_OK)
+    {
+        pcb->batch_error = error;
+    }
+
+    pcb->batch_pending -= 1;
+
+    if (pcb->batch_pending != 0)
+    {
+        return;
+    }
+
+    if (pcb->batch_sent != NULL)
+    {
+        pcb->batch_sent(pcb->batch_arg, pcb->batch_error);
+    }
+    else
+    {
+        raw_sent(pcb, pcb->batch_error);
+    }
+}
+
+lwcanerr_t canraw_send_batch(struct canraw_pcb *pcb, void *frames, uint8_t frame_size, uint16_t count, uint32_t timeout, canif_sent_function sent, void *arg)
+{
+    struct canif *canif;
+
+    uint8_t *frame;
+
+    lwcanerr_t ret;
+
+    if (pcb == NULL || frames == NULL || frame_size == 0 || count == 0)
+    {
+        LWCAN_ASSERT("pcb != NULL", pcb != NULL);
+        LWCAN_ASSERT("frames != NULL", frames != NULL);
+        LWCAN_ASSERT("frame_size != 0", frame_size != 0);
+        LWCAN_ASSERT("count != 0", count != 0);
+
+        return ERROR_ARG;
+    }
+
+    canif = canif_get_by_index(pcb->if_index);
+
+    if (canif == NULL)
+    {
+        return ERROR_CANIF;
+    }
+
+    if (canif->output_batch == NULL)
+    {
+        if (pcb->batch_pending != 0)
+        {
+            return ERROR_INPROGRESS;
+        }
+
+        pcb->batch_queued = 0;
+
+        pcb->batch_error = ERROR_OK;
+
+        pcb->batch_sent = sent;
+
+        pcb->batch_arg = arg;
+
+        /*
+         *  Set once before queuing, completions only ever count it down. The extra count keeps a synchronous
+         *  driver from completing the batch while it is still queued
+         */
+        pcb->batch_pending = (uint32_t)count + 1;
+
+        ret = ERROR_OK;
+
+        for (frame = (uint8_t *)frames; pcb->batch_queued < count; frame += frame_size)
+        {
+            ret = canif->output(canif, frame, frame_size, timeout, raw_batch_sent, pcb);
+
+            if (ret != ERROR_OK)
+            {
+                break;
+            }
+
+            pcb->batch_queued += 1;
+        }
+
+        /* Nothing was queued, no completion follows the error */
+        if (pcb->batch_queued == 0)
+        {
+            pcb->batch_pending = 0;
+
+            return ret;
+        }
+
+        /* Frames the interface refused never complete, they go together with the extra count */
+        pcb->batch_pending -= (uint32_t)(count - pcb->batch_queued);
+
+        raw_batch_sent(pcb, ret);
+
+        if (sent != NULL)
+        {
+            return ret;
+        }
+    }
+    else
+    {
+        if (sent != NULL)
+        {
+            ret = canif->output_batch(canif, frames, frame_size, count, timeout, sent, arg);
+
+            pcb->batch_queued = (ret == ERROR_OK) ? count : 0;
+
+            return ret;
+        }
+
+        ret = canif->output_batch(canif, frames, frame_size, count, timeout, raw_sent, pcb);
+
+        if (ret != ERROR_OK)
+        {
+            pcb->batch_queued = 0;
+
+            return ret;
+        }
+
+        pcb->batch_queued = count;
+    }
+
+    while (!pcb->sent)
+    {
+    }
+
+    pcb->sent = 0;
+
+    return pcb->sent_error;
+}
+
 lwcanerr_t canraw_set_receive_callback(struct canraw_pcb *pcb, canraw_receive_function receive)
 {
     if (pcb == NULL)
@@ -1,5 +1,6 @@
 #include "lwcan/timeouts.h"
 #include "lwcan/private/timeouts_private.h"
+#include "lwcan/private/memp_private.h"
 #include "lwcan/error.h"
 #include "lwcan/system.h"
 #include "lwcan/options.h"
@@ -10,204 +11,1080 @@
 
 #define MAX_TIMEOUT 0x7fffffff
 
-#define TIME_LESS_THAN(time, compare_to) ((((uint32_t)(time - compare_to)) > MAX_TIMEOUT) ? 1 : 0)
+#define TIME_LESS_THAN(time, compare_to) ((((uint32_t)((time) - (compare_to))) > MAX_TIMEOUT) ? 1 : 0)
 
-#define TIMEOUT_MEM_CHUNK_SIZE sizeof(struct lwcan_timeout)
+#if LWCAN_DEFER_NUM < 1 || LWCAN_DEFER_NUM > 255
+#error "LWCAN_DEFER_NUM must be between 1 and 255"
+#endif
 
-#define TIMEOUT_MEM_POOL_SIZE (TIMEOUT_MEM_CHUNK_SIZE * LWCAN_TIMEOUTS_NUM)
+#if LWCAN_TIMEOUT_WHEEL_BITS < 2 || LWCAN_TIMEOUT_WHEEL_BITS > 5
+#error "LWCAN_TIMEOUT_WHEEL_BITS must be between 2 and 5"
+#endif
 
-#define TIMEOUT_MEM_POOL_BEGIN_ADDR (uint8_t *)(&timeout_mem_pool[0])
+/*
+ * Hierarchical timing wheel. Level 0 has one slot per millisecond, every next
+ * level has slots 1 << WHEEL_BITS times longer. A timer is put on the level of
+ * the highest group of bits in which its time differs from wheel_time, so every
+ * level 0 slot holds a single time. The slot of a higher level is cascaded down
+ * when wheel_time reaches its start, which keeps timeouts of equal time in the
+ * order they were added.
+ */
+#define WHEEL_BITS      LWCAN_TIMEOUT_WHEEL_BITS
+#define WHEEL_SLOTS     (1U << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    ((32 + WHEEL_BITS - 1) / WHEEL_BITS)
 
-#define TIMEOUT_MEM_POOL_END_ADDR (uint8_t *)(&timeout_mem_pool[TIMEOUT_MEM_POOL_SIZE - 1])
+#define WHEEL_SHIFT(level)  ((level) * WHEEL_BITS)
+#define WHEEL_INDEX(time, level) (((time) >> WHEEL_SHIFT(level)) & WHEEL_MASK)
 
-#define TIMEOUT_MEM_POOL_SERVICE_BEGIN_IDX TIMEOUT_MEM_POOL_SIZE
+/* Bits below the start of a slot of the given level */
+#define WHEEL_LOW_MASK(level) ((level) == 0 ? 0 : ((uint32_t)0xffffffff >> (32 - WHEEL_SHIFT(level))))
 
-#define TIMEOUT_MEM_POOL_SERVICE_END_IDX ((TIMEOUT_MEM_POOL_SIZE + LWCAN_TIMEOUTS_NUM) - 1)
+static struct lwcan_timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
 
-struct lwcan_timeout
-{
-    struct lwcan_timeout *next;
+/* Bitmap of non empty slots, one per level */
+static uint32_t wheel_occupied[WHEEL_LEVELS];
 
-    uint32_t time;
+/* Last millisecond the wheel has been advanced to */
+static uint32_t wheel_time;
 
-    lwcan_timeout_handler handler;
+/* Time of the next slot to expire or cascade, it may be early but never late */
+static uint32_t wheel_event;
+
+/* Timers whose time has come, run in order by lwcan_timeouts_handler() */
+static struct lwcan_timer *expired_timers;
+
+struct deferred_call
+{
+    lwcan_timeout_handler handler; /** NULL once the call has been dropped by lwcan_undefer() */
 
     void *arg;
 };
 
-static uint8_t timeout_mem_pool[TIMEOUT_MEM_POOL_SIZE + LWCAN_TIMEOUTS_NUM];
+/* Ring of deferred calls, run before the timers */
+static struct deferred_call deferred_calls[LWCAN_DEFER_NUM];
+
+static uint8_t deferred_head;
+
+static uint8_t deferred_num;
+
+static lwcan_timeouts_earliest_callback earliest_callback;
+
+/* Deadline the host knows of, from lwcan_timeouts_next_expiry() or the earliest callback */
+static uint32_t earliest_known;
+
+static bool earliest_known_valid;
+
+#if LWCAN_VIRTUAL_CLOCK
+static uint64_t virtual_clock_ns;
+
+#if !LWCAN_SYSTEM_NOW_NS
+#error "LWCAN_VIRTUAL_CLOCK needs LWCAN_SYSTEM_NOW_NS"
+#endif
+#endif
+
+#if !LWCAN_SYSTEM_NOW_NS
+/* system_now() extended to 64 bits, it must be read at least once per wrap of 49 days */
+static uint32_t clock_last;
+
+static uint32_t clock_wraps;
+#endif
+
+#if LWCAN_TIMEOUTS_STATS
+static struct lwcan_timeouts_stats timeouts_stats;
 
-static struct lwcan_timeout *next_timeout;
+static struct lwcan_timeouts_handler_stats handler_stats[LWCAN_TIMEOUTS_STATS];
 
-static void *timeout_malloc(void)
+static uint8_t handler_stats_num;
+
+static void timeout_expired(void *arg);
+#endif
+
+/* Set while lwcan_timeouts_handler() runs, the host asks for the next deadline after it */
+static bool handler_running;
+
+/* Index of the lowest set bit, word must not be zero */
+static inline uint8_t timeout_ffs(uint32_t word)
+{
+#if defined(__GNUC__)
+    return (uint8_t)__builtin_ctz(word);
+#else
+    uint8_t bit = 0;
+
+    if ((word & 0xFFFF) == 0) { word >>= 16; bit += 16; }
+    if ((word & 0xFF) == 0) { word >>= 8; bit += 8; }
+    if ((word & 0xF) == 0) { word >>= 4; bit += 4; }
+    if ((word & 0x3) == 0) { word >>= 2; bit += 2; }
+    if ((word & 0x1) == 0) { bit += 1; }
+
+    return bit;
+#endif
+}
+
+/* Index of the highest set bit, word must not be zero */
+static inline uint8_t timeout_fls(uint32_t word)
 {
-    for (uint16_t i = TIMEOUT_MEM_POOL_SERVICE_BEGIN_IDX; i <= TIMEOUT_MEM_POOL_SERVICE_END_IDX; i++)
+#if defined(__GNUC__)
+    return (uint8_t)(31 - __builtin_clz(word));
+#else
+    uint8_t bit = 0;
+
+    while (word > 1)
     {
-        if (timeout_mem_pool[i] == 0)
+        word >>= 1;
+
+        bit++;
+    }
+
+    return bit;
+#endif
+}
+
+static void timer_list_append(struct lwcan_timer **list, struct lwcan_timer *timer)
+{
+    if (*list == NULL)
+    {
+        timer->next = timer;
+
+        timer->prev = timer;
+
+        *list = timer;
+    }
+    else
+    {
+        timer->next = *list;
+
+        timer->prev = (*list)->prev;
+
+        (*list)->prev->next = timer;
+
+        (*list)->prev = timer;
+    }
+
+    timer->list = list;
+}
+
+static void timer_list_remove(struct lwcan_timer *timer)
+{
+    struct lwcan_timer **list = timer->list;
+
+    uint32_t slot;
+
+    if (timer->next == timer)
+    {
+        *list = NULL;
+
+        /* The slot is empty now, unless the timer was in the expired list */
+        if (list != &expired_timers)
         {
-            timeout_mem_pool[i] = 0xAA;
+            slot = (uint32_t)(list - &wheel[0][0]);
+
+            wheel_occupied[slot / WHEEL_SLOTS] &= ~((uint32_t)1 << (slot % WHEEL_SLOTS));
+        }
+    }
+    else
+    {
+        timer->prev->next = timer->next;
+
+        timer->next->prev = timer->prev;
 
-            return (void *)&timeout_mem_pool[(i - TIMEOUT_MEM_POOL_SERVICE_BEGIN_IDX)  * TIMEOUT_MEM_CHUNK_SIZE];
+        if (*list == timer)
+        {
+            *list = timer->next;
         }
     }
 
-    return NULL;
+    timer->list = NULL;
+
+#if LWCAN_TIMEOUTS_STATS
+    timeouts_stats.armed -= 1;
+#endif
 }
 
-static void timeout_free(void *mem)
+/* Put a timer on the wheel relative to wheel_time, or in the expired list if its time has come */
+static void timer_insert(struct lwcan_timer *timer)
 {
-    uint16_t idx;
+    uint8_t level;
 
-    uint8_t addr;
+    uint32_t slot;
+
+#if LWCAN_TIMEOUTS_STATS
+    /* Timers cascaded down the wheel still point to their old slot */
+    if (timer->list == NULL && ++timeouts_stats.armed > timeouts_stats.armed_max)
+    {
+        timeouts_stats.armed_max = timeouts_stats.armed;
+    }
+#endif
 
-    /* Checking an address for inclusion in a memory pool */
-    if (mem == NULL || (uint8_t *)mem < TIMEOUT_MEM_POOL_BEGIN_ADDR || (uint8_t *)mem > TIMEOUT_MEM_POOL_END_ADDR)
+    if (!TIME_LESS_THAN(wheel_time, timer->time))
     {
+        timer_list_append(&expired_timers, timer);
+
         return;
     }
 
-    /* get address within memory pool */
-    addr = (uint8_t *)mem - TIMEOUT_MEM_POOL_BEGIN_ADDR;
+    level = (uint8_t)(timeout_fls(timer->time ^ wheel_time) / WHEEL_BITS);
+
+    slot = WHEEL_INDEX(timer->time, level);
+
+    timer_list_append(&wheel[level][slot], timer);
+
+    wheel_occupied[level] |= (uint32_t)1 << slot;
+
+    /* The slot is handled when wheel_time reaches its start */
+    if (TIME_LESS_THAN(timer->time & ~WHEEL_LOW_MASK(level), wheel_event))
+    {
+        wheel_event = timer->time & ~WHEEL_LOW_MASK(level);
+    }
+}
+
+/* Milliseconds from wheel_time to the next slot which has to be expired or cascaded */
+static uint32_t timeouts_next_event(void)
+{
+    uint32_t distance = MAX_TIMEOUT;
+
+    uint32_t occupied, start, event;
+
+    uint8_t index;
+
+    for (uint8_t level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if (wheel_occupied[level] == 0)
+        {
+            continue;
+        }
+
+        index = (uint8_t)WHEEL_INDEX(wheel_time, level);
+
+        /* Slots behind the current one only exist on the top level, for times past the wrap of the clock */
+        occupied = wheel_occupied[level] & ~(((uint32_t)2 << index) - 1);
+
+        /* Start of the current turn of this level */
+        start = wheel_time & ~(WHEEL_LOW_MASK(level) | ((uint32_t)WHEEL_MASK << WHEEL_SHIFT(level)));
+
+        if (occupied == 0)
+        {
+            occupied = wheel_occupied[level];
+
+            start += (uint32_t)WHEEL_SLOTS << WHEEL_SHIFT(level);
+        }
+
+        event = (uint32_t)(start + ((uint32_t)timeout_ffs(occupied) << WHEEL_SHIFT(level)) - wheel_time);
+
+        if (event < distance)
+        {
+            distance = event;
+        }
+    }
+
+    return distance;
+}
+
+/* Move wheel_time to wheel_event: cascade the slots starting there and expire the level 0 slot */
+static void timeouts_advance(void)
+{
+    struct lwcan_timer *list, *timer;
+
+    uint32_t slot;
+
+    wheel_time = wheel_event;
+
+    /* Nothing is on the wheel past wheel_time, the timeouts put back below move it closer */
+    wheel_event = wheel_time + MAX_TIMEOUT;
+
+    for (uint8_t level = WHEEL_LEVELS; level-- > 0;)
+    {
+        if ((wheel_time & WHEEL_LOW_MASK(level)) != 0)
+        {
+            continue;
+        }
+
+        slot = WHEEL_INDEX(wheel_time, level);
+
+        list = wheel[level][slot];
+
+        if (list == NULL)
+        {
+            continue;
+        }
+
+        wheel[level][slot] = NULL;
+
+        wheel_occupied[level] &= ~((uint32_t)1 << slot);
+
+        /* Unlink the circular list before the timeouts are put into their new places */
+        list->prev->next = NULL;
+
+        while (list != NULL)
+        {
+            timer = list;
+
+            list = list->next;
+
+            timer_insert(timer);
+        }
+    }
+
+    wheel_event = wheel_time + timeouts_next_event();
+}
+
+/* Put a periodic timer back, its next deadline is counted from the one which has just passed */
+static void timer_insert_next_period(struct lwcan_timer *timer, uint32_t now)
+{
+    uint32_t late;
+
+    timer->time += timer->period;
+
+    /* The handler has fallen behind by a whole period or more */
+    if (timer->catch_up == LWCAN_TIMER_CATCH_UP_SKIP && !TIME_LESS_THAN(now, timer->time))
+    {
+        late = (uint32_t)(now - timer->time);
+
+        timer->time += (late / timer->period + 1) * timer->period;
+    }
+
+    timer_insert(timer);
+}
+
+#if LWCAN_TIMEOUTS_STATS
+static uint8_t timeouts_stats_bucket(uint32_t value)
+{
+    uint8_t bucket;
+
+    if (value == 0)
+    {
+        return 0;
+    }
+
+    bucket = (uint8_t)(timeout_fls(value) + 1);
+
+    return (bucket < LWCAN_TIMEOUTS_STATS_BUCKETS) ? bucket : (LWCAN_TIMEOUTS_STATS_BUCKETS - 1);
+}
+
+/* Account one call of a timer handler which was late ms after its deadline and ran from start on */
+static void timeouts_stats_record(lwcan_timeout_handler handler, uint32_t late, uint64_t start)
+{
+    struct lwcan_timeouts_handler_stats *stats = NULL;
+
+    uint64_t run;
+
+    run = (lwcan_now_ns() - start) / 1000U;
+
+    for (uint8_t i = 0; i < handler_stats_num; i++)
+    {
+        if (handler_stats[i].handler == handler)
+        {
+            stats = &handler_stats[i];
+
+            break;
+        }
+    }
+
+    if (stats == NULL)
+    {
+        if (handler_stats_num == LWCAN_TIMEOUTS_STATS)
+        {
+            timeouts_stats.untracked += 1;
+
+            return;
+        }
+
+        stats = &handler_stats[handler_stats_num++];
+
+        stats->handler = handler;
+    }
+
+    if (run > 0xffffffffU)
+    {
+        run = 0xffffffffU;
+    }
+
+    stats->count += 1;
+
+    stats->late[timeouts_stats_bucket(late)] += 1;
+
+    stats->run[timeouts_stats_bucket((uint32_t)run)] += 1;
+
+    if (late > stats->late_max)
+    {
+        stats->late_max = late;
+    }
+
+    if ((uint32_t)run > stats->run_max)
+    {
+        stats->run_max = (uint32_t)run;
+    }
+}
+#endif
+
+/* Time of the timer on the wheel which expires first, or false if the wheel is empty */
+static bool timeouts_earliest(uint32_t *time)
+{
+    struct lwcan_timer *list, *timer;
+
+    uint32_t occupied;
+
+    uint8_t level = 0;
+
+    /* Lower levels expire before higher ones */
+    while (wheel_occupied[level] == 0)
+    {
+        if (++level == WHEEL_LEVELS)
+        {
+            return false;
+        }
+    }
+
+    /* Slots after the current one expire before those which have wrapped around, on the top level */
+    occupied = wheel_occupied[level] & ~(((uint32_t)2 << WHEEL_INDEX(wheel_time, level)) - 1);
+
+    if (occupied == 0)
+    {
+        occupied = wheel_occupied[level];
+    }
+
+    list = wheel[level][timeout_ffs(occupied)];
 
-    /* check address for multiple of chunk size */
-    if ((addr % TIMEOUT_MEM_CHUNK_SIZE) != 0)
+    *time = list->time;
+
+    /* Slots of levels above 0 are not sorted by time */
+    for (timer = list->next; timer != list; timer = timer->next)
+    {
+        if (TIME_LESS_THAN(timer->time, *time))
+        {
+            *time = timer->time;
+        }
+    }
+
+    return true;
+}
+
+/* Call the earliest callback if time is before the deadline the host knows of */
+static void timeouts_notify(uint32_t time)
+{
+    uint32_t now;
+
+    if (earliest_callback == NULL || handler_running)
+    {
+        return;
+    }
+
+    if (earliest_known_valid && !TIME_LESS_THAN(time, earliest_known))
     {
         return;
     }
 
-    /* get the index of the element which means that the chunk has been allocated */
-    idx = TIMEOUT_MEM_POOL_SERVICE_BEGIN_IDX + (addr / TIMEOUT_MEM_CHUNK_SIZE);
+    earliest_known = time;
 
-    /* freeing the chunk */
-    timeout_mem_pool[idx] = 0;
+    earliest_known_valid = true;
+
+    now = system_now();
+
+    earliest_callback(TIME_LESS_THAN(now, time) ? (uint32_t)(time - now) : 0);
 }
 
 void lwcan_timeouts_init(void)
 {
-    memset(timeout_mem_pool, 0, sizeof(timeout_mem_pool));
+    for (uint8_t level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (uint8_t slot = 0; slot < WHEEL_SLOTS; slot++)
+        {
+            wheel[level][slot] = NULL;
+        }
+
+        wheel_occupied[level] = 0;
+    }
+
+    expired_timers = NULL;
+
+    deferred_head = 0;
+
+    deferred_num = 0;
+
+    earliest_known_valid = false;
+
+    handler_running = false;
+
+#if LWCAN_TIMEOUTS_STATS
+    memset(&timeouts_stats, 0, sizeof(timeouts_stats));
+
+    memset(handler_stats, 0, sizeof(handler_stats));
 
-    next_timeout = NULL;
+    handler_stats_num = 0;
+#endif
+
+#if !LWCAN_SYSTEM_NOW_NS
+    clock_last = system_now();
+
+    clock_wraps = 0;
+#endif
+
+    wheel_time = system_now();
+
+    wheel_event = wheel_time + MAX_TIMEOUT;
 }
 
 void lwcan_timeouts_handler(void)
+{
+    (void)lwcan_timeouts_handler_budget(0, 0);
+}
+
+uint8_t lwcan_timeouts_handler_budget(uint16_t max_calls, uint32_t max_us)
 {
     uint32_t now;
 
-    struct lwcan_timeout *timeout;
+    struct lwcan_timer *timer;
 
+    struct deferred_call call;
+
+    uint8_t remaining = 0;
+
+    uint16_t calls = 0;
+
+    uint64_t pass_start = 0;
+
+#if LWCAN_TIMEOUTS_STATS
     lwcan_timeout_handler handler;
 
-    void *arg;
+    uint32_t late;
+
+    uint64_t start;
+#endif
 
     now = system_now();
 
-    do
+#if !LWCAN_SYSTEM_NOW_NS
+    /* Keeps lwcan_now_ns() from missing a wrap of the clock */
+    (void)lwcan_now_ns();
+#endif
+
+    if (max_us != 0)
     {
-        timeout = next_timeout;
+        pass_start = lwcan_now_ns();
+    }
 
-        if (timeout == NULL)
+    handler_running = true;
+
+    do
+    {
+        /* The budget is checked between calls, a handler is never interrupted */
+        if ((max_calls != 0 && calls >= max_calls) ||
+            (max_us != 0 && calls != 0 && (lwcan_now_ns() - pass_start) >= (uint64_t)max_us * 1000U))
         {
-            return;
+            /* A due cascade counts as work, the next pass may find no timer in it */
+            remaining = (deferred_num != 0 || expired_timers != NULL ||
+                         (TIME_LESS_THAN(wheel_time, now) && !TIME_LESS_THAN(now, wheel_event))) ? 1 : 0;
+
+            break;
         }
 
-        if (TIME_LESS_THAN(now, timeout->time))
+        /* Deferred calls go first, including those deferred by the handlers run in this pass */
+        if (deferred_num != 0)
         {
-            return;
+            call = deferred_calls[deferred_head];
+
+            deferred_head = (uint8_t)((deferred_head + 1) % LWCAN_DEFER_NUM);
+
+            deferred_num -= 1;
+
+            if (call.handler != NULL)
+            {
+                call.handler(call.arg);
+
+                calls += 1;
+            }
+
+            continue;
         }
 
-        next_timeout = timeout->next;
+        /* Handlers can arm timers which are already expired, they are run in the same pass */
+        if (expired_timers != NULL)
+        {
+            timer = expired_timers;
+
+            /* The timer is not armed anymore when its handler runs, so the handler can arm it again */
+            timer_list_remove(timer);
+
+#if LWCAN_TIMEOUTS_STATS
+            /* Pool timeouts are accounted to the handler given to lwcan_timeout() */
+            handler = (timer->handler == timeout_expired) ? ((struct lwcan_timeout *)timer->arg)->handler : timer->handler;
+
+            late = (uint32_t)(system_now() - timer->time);
+
+            if (late > MAX_TIMEOUT)
+            {
+                late = 0;
+            }
+
+            start = lwcan_now_ns();
+#endif
+
+            /* Periodic timers are armed again first, the handler can still cancel them */
+            if (timer->period != 0)
+            {
+                timer_insert_next_period(timer, now);
+            }
+
+            if (timer->handler != NULL)
+            {
+                timer->handler(timer->arg);
+            }
+
+            calls += 1;
 
-        handler = timeout->handler;
+#if LWCAN_TIMEOUTS_STATS
+            timeouts_stats_record(handler, late, start);
+#endif
 
-        arg = timeout->arg;
+            continue;
+        }
 
-        timeout_free(timeout);
+        if (!TIME_LESS_THAN(wheel_time, now))
+        {
+            break;
+        }
 
-        if (handler != NULL)
+        /* Nothing happens up to now, the wheel can jump there at once */
+        if (TIME_LESS_THAN(now, wheel_event))
         {
-            handler(arg);
+            wheel_time = now;
+
+            break;
         }
 
-    /* Repeat until all expired timers have been called */
+        timeouts_advance();
+
+    /* Repeat until all expired timers have been called or the budget is spent */
     } while (1);
+
+    handler_running = false;
+
+    return remaining;
 }
 
-void lwcan_timeout(uint32_t time_ms, lwcan_timeout_handler handler, void *arg)
+uint32_t lwcan_timeouts_next_expiry(void)
 {
-    uint32_t timeout_time;
+    uint32_t now, time;
 
-    struct lwcan_timeout *new_timeout, *timeout;
+    now = system_now();
 
-    new_timeout = (struct lwcan_timeout *)timeout_malloc();
+    if (deferred_num != 0 || expired_timers != NULL)
+    {
+        time = now;
+    }
+    else if (!timeouts_earliest(&time))
+    {
+        earliest_known_valid = false;
 
-    if (new_timeout == NULL)
+        return LWCAN_TIMEOUTS_NO_EXPIRY;
+    }
+
+    earliest_known = time;
+
+    earliest_known_valid = true;
+
+    return TIME_LESS_THAN(now, time) ? (uint32_t)(time - now) : 0;
+}
+
+void lwcan_timeouts_set_earliest_callback(lwcan_timeouts_earliest_callback callback)
+{
+    earliest_callback = callback;
+}
+
+lwcanerr_t lwcan_defer(lwcan_timeout_handler handler, void *arg)
+{
+    struct deferred_call *call;
+
+    if (handler == NULL)
     {
-        LWCAN_ASSERT("new_timeout != NULL", new_timeout != NULL);
+        LWCAN_ASSERT("handler != NULL", handler != NULL);
+
+        return ERROR_ARG;
+    }
+
+    if (deferred_num >= LWCAN_DEFER_NUM)
+    {
+        return ERROR_MEMORY;
+    }
+
+    call = &deferred_calls[(deferred_head + deferred_num) % LWCAN_DEFER_NUM];
+
+    call->handler = handler;
+
+    call->arg = arg;
+
+    deferred_num += 1;
+
+#if LWCAN_TIMEOUTS_STATS
+    if (deferred_num > timeouts_stats.deferred_max)
+    {
+        timeouts_stats.deferred_max = deferred_num;
+    }
+#endif
+
+    timeouts_notify(system_now());
+
+    return ERROR_OK;
+}
+
+void lwcan_undefer(lwcan_timeout_handler handler, void *arg)
+{
+    struct deferred_call *call;
+
+    /* Dropped calls keep their place in the ring and are skipped when their turn comes */
+    for (uint8_t i = 0; i < deferred_num; i++)
+    {
+        call = &deferred_calls[(deferred_head + i) % LWCAN_DEFER_NUM];
+
+        if (call->handler == handler && call->arg == arg)
+        {
+            call->handler = NULL;
+        }
+    }
+}
+
+void lwcan_timer_init(struct lwcan_timer *timer, lwcan_timeout_handler handler, void *arg)
+{
+    if (timer == NULL)
+    {
+        LWCAN_ASSERT("timer != NULL", timer != NULL);
 
         return;
     }
 
-    timeout_time = (uint32_t)(system_now() + time_ms);
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->list = NULL;
+    timer->time = 0;
+    timer->period = 0;
+    timer->catch_up = LWCAN_TIMER_CATCH_UP_SKIP;
+    timer->handler = handler;
+    timer->arg = arg;
+}
 
-    new_timeout->next = NULL;
-    new_timeout->handler = handler;
-    new_timeout->arg = arg;
-    new_timeout->time = timeout_time;
+lwcanerr_t lwcan_timer_arm(struct lwcan_timer *timer, uint32_t time_ms)
+{
+    if (timer == NULL || time_ms > MAX_TIMEOUT)
+    {
+        LWCAN_ASSERT("timer != NULL", timer != NULL);
+        LWCAN_ASSERT("time_ms <= MAX_TIMEOUT", time_ms <= MAX_TIMEOUT);
+
+        return ERROR_ARG;
+    }
 
-    if (next_timeout == NULL)
+    if (timer->list != NULL)
     {
-        next_timeout = new_timeout;
+        return ERROR_INPROGRESS;
+    }
+
+    timer->time = (uint32_t)(system_now() + time_ms);
+
+    timer->period = 0;
+
+    timer_insert(timer);
+
+    timeouts_notify(timer->time);
+
+    return ERROR_OK;
+}
+
+lwcanerr_t lwcan_timer_arm_periodic(struct lwcan_timer *timer, uint32_t period_ms, lwcan_timer_catch_up_t catch_up)
+{
+    lwcanerr_t ret;
+
+    if (period_ms == 0)
+    {
+        LWCAN_ASSERT("period_ms != 0", period_ms != 0);
+
+        return ERROR_ARG;
+    }
+
+    ret = lwcan_timer_arm(timer, period_ms);
+
+    if (ret != ERROR_OK)
+    {
+        return ret;
+    }
+
+    timer->period = period_ms;
+
+    timer->catch_up = (uint8_t)catch_up;
+
+    return ERROR_OK;
+}
+
+void lwcan_timer_rearm_periodic(struct lwcan_timer *timer, uint32_t period_ms, lwcan_timer_catch_up_t catch_up)
+{
+    if (timer == NULL)
+    {
+        LWCAN_ASSERT("timer != NULL", timer != NULL);
 
         return;
     }
 
-    if (TIME_LESS_THAN(new_timeout->time, next_timeout->time))
+    lwcan_timer_cancel(timer);
+
+    lwcan_timer_arm_periodic(timer, period_ms, catch_up);
+}
+
+void lwcan_timer_rearm(struct lwcan_timer *timer, uint32_t time_ms)
+{
+    if (timer == NULL)
     {
-        new_timeout->next = next_timeout;
+        LWCAN_ASSERT("timer != NULL", timer != NULL);
 
-        next_timeout = new_timeout;
+        return;
     }
-    else
+
+    lwcan_timer_cancel(timer);
+
+    lwcan_timer_arm(timer, time_ms);
+}
+
+void lwcan_timer_cancel(struct lwcan_timer *timer)
+{
+    if (timer == NULL || timer->list == NULL)
     {
-        for (timeout = next_timeout; timeout != NULL; timeout = timeout->next)
-        {
-            if ((timeout->next == NULL) || TIME_LESS_THAN(new_timeout->time, timeout->next->time))
-            {
-                new_timeout->next = timeout->next;
+        return;
+    }
 
-                timeout->next = new_timeout;
+    timer_list_remove(timer);
+}
 
-                break;
-            }
-        }
+uint8_t lwcan_timer_is_armed(const struct lwcan_timer *timer)
+{
+    return (timer != NULL && timer->list != NULL) ? 1 : 0;
+}
+
+uint64_t lwcan_now_ns(void)
+{
+#if LWCAN_SYSTEM_NOW_NS
+    return system_now_ns();
+#else
+    uint32_t now;
+
+    now = system_now();
+
+    if (now < clock_last)
+    {
+        clock_wraps += 1;
     }
+
+    clock_last = now;
+
+    return ((((uint64_t)clock_wraps) << 32) | now) * 1000000U;
+#endif
 }
 
-void lwcan_untimeout(lwcan_timeout_handler handler, void *arg)
+/* Pool timeouts are freed before their handler is called, so it can add a new one right away */
+static void timeout_expired(void *arg)
+{
+    struct lwcan_timeout *timeout = (struct lwcan_timeout *)arg;
+
+    lwcan_timeout_handler handler;
+
+    handler = timeout->handler;
+
+    arg = timeout->arg;
+
+    lwcan_memp_free(LWCAN_MEMP_TIMEOUT, timeout);
+
+    if (handler != NULL)
+    {
+        handler(arg);
+    }
+}
+
+void lwcan_timeout(uint32_t time_ms, lwcan_timeout_handler handler, void *arg)
 {
-    struct lwcan_timeout *timeout, *previous_timeout;
+    struct lwcan_timeout *new_timeout;
 
-    if (next_timeout == NULL)
+    new_timeout = (struct lwcan_timeout *)lwcan_memp_malloc(LWCAN_MEMP_TIMEOUT);
+
+    if (new_timeout == NULL)
     {
+        LWCAN_ASSERT("new_timeout != NULL", new_timeout != NULL);
+
         return;
     }
 
-    for (timeout = next_timeout, previous_timeout = NULL; timeout != NULL; previous_timeout = timeout, timeout = timeout->next)
+    new_timeout->handler = handler;
+    new_timeout->arg = arg;
+
+    lwcan_timer_init(&new_timeout->timer, timeout_expired, new_timeout);
+
+    new_timeout->timer.time = (uint32_t)(system_now() + time_ms);
+
+    timer_insert(&new_timeout->timer);
+
+    timeouts_notify(new_timeout->timer.time);
+}
+
+/* The matching pool timeout which expires first, slots of levels above 0 are not sorted by time */
+static struct lwcan_timer *timeout_find(struct lwcan_timer *list, lwcan_timeout_handler handler, void *arg)
+{
+    struct lwcan_timer *timer = list, *found = NULL;
+
+    struct lwcan_timeout *timeout;
+
+    if (timer == NULL)
     {
-        if ((timeout->handler == handler) && (timeout->arg == arg))
+        return NULL;
+    }
+
+    do
+    {
+        /* Timers owned by the caller are only cancelled through lwcan_timer_cancel() */
+        if (timer->handler == timeout_expired)
         {
-            if (previous_timeout == NULL)
+            timeout = (struct lwcan_timeout *)timer->arg;
+
+            if ((timeout->handler == handler) && (timeout->arg == arg) &&
+                (found == NULL || TIME_LESS_THAN(timer->time, found->time)))
             {
-                next_timeout = timeout->next;
+                found = timer;
             }
-            else
+        }
+
+        timer = timer->next;
+    } while (timer != list);
+
+    return found;
+}
+
+void lwcan_untimeout(lwcan_timeout_handler handler, void *arg)
+{
+    struct lwcan_timer *timer;
+
+    uint32_t occupied, later;
+
+    uint8_t slot;
+
+    /* Like the sorted list this replaces, the timeout which expires first is removed.
+     * Lower levels expire before higher ones, and slots after the current one before
+     * those which have wrapped around */
+    timer = timeout_find(expired_timers, handler, arg);
+
+    for (uint8_t level = 0; level < WHEEL_LEVELS && timer == NULL; level++)
+    {
+        later = ~(((uint32_t)2 << WHEEL_INDEX(wheel_time, level)) - 1);
+
+        occupied = wheel_occupied[level] & later;
+
+        while (timer == NULL && (occupied != 0 || (later != 0 && (wheel_occupied[level] & ~later) != 0)))
+        {
+            if (occupied == 0)
             {
-                previous_timeout->next = timeout->next;
+                occupied = wheel_occupied[level] & ~later;
+
+                later = 0;
             }
 
-            timeout_free(timeout);
+            slot = timeout_ffs(occupied);
 
-            return;
+            occupied &= occupied - 1;
+
+            timer = timeout_find(wheel[level][slot], handler, arg);
         }
     }
+
+    if (timer == NULL)
+    {
+        return;
+    }
+
+    timer_list_remove(timer);
+
+    lwcan_memp_free(LWCAN_MEMP_TIMEOUT, timer->arg);
+}
+
+#if LWCAN_TIMEOUTS_STATS
+lwcanerr_t lwcan_timeouts_get_stats(struct lwcan_timeouts_stats *stats)
+{
+    if (stats == NULL)
+    {
+        LWCAN_ASSERT("stats != NULL", stats != NULL);
+
+        return ERROR_ARG;
+    }
+
+    memcpy(stats, &timeouts_stats, sizeof(struct lwcan_timeouts_stats));
+
+    return ERROR_OK;
+}
+
+lwcanerr_t lwcan_timeouts_get_handler_stats(uint8_t index, struct lwcan_timeouts_handler_stats *stats)
+{
+    if (stats == NULL)
+    {
+        LWCAN_ASSERT("stats != NULL", stats != NULL);
+
+        return ERROR_ARG;
+    }
+
+    if (index >= handler_stats_num)
+    {
+        return ERROR_ARG;
+    }
+
+    memcpy(stats, &handler_stats[index], sizeof(struct lwcan_timeouts_handler_stats));
+
+    return ERROR_OK;
+}
+
+void lwcan_timeouts_reset_stats(void)
+{
+    uint16_t armed;
+
+    armed = timeouts_stats.armed;
+
+    memset(&timeouts_stats, 0, sizeof(timeouts_stats));
+
+    timeouts_stats.armed = armed;
+
+    timeouts_stats.armed_max = armed;
+
+    memset(handler_stats, 0, sizeof(handler_stats));
+
+    handler_stats_num = 0;
+}
+#endif
+
+#if LWCAN_VIRTUAL_CLOCK
+uint32_t system_now(void)
+{
+    return (uint32_t)(virtual_clock_ns / 1000000U);
+}
+
+uint64_t system_now_ns(void)
+{
+    return virtual_clock_ns;
+}
+
+void lwcan_clock_advance_ns(uint64_t time_ns)
+{
+    virtual_clock_ns += time_ns;
+}
+
+uint8_t lwcan_clock_step(void)
+{
+    uint32_t next;
+
+    next = lwcan_timeouts_next_expiry();
+
+    if (next == LWCAN_TIMEOUTS_NO_EXPIRY)
+    {
+        return 0;
+    }
+
+    /* Deadlines are whole milliseconds */
+    if (next != 0)
+    {
+        virtual_clock_ns = (virtual_clock_ns / 1000000U + next) * 1000000U;
+    }
+
+    lwcan_timeouts_handler();
+
+    return 1;
 }
+#endif